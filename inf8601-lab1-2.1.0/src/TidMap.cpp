@@ -7,65 +7,91 @@
 
 #include <iostream>
 
+#include "config.h"
+
+#ifdef HAVE_LIBTBB
+
 #include "tbb/tbb.h"
 #include "TidMap.h"
 
+extern "C" {
+#include "utils.h"
+#include "metrics.h"
+}
+
 using std::ostream;
 using namespace tbb;
 using namespace std;
 
-TidMap::TidMap(int size) : size(size), pos(0) {
-	array = new int[size];
-	int i;
-	for (i = 0; i < size; i++) {
-		array[i] = 0;
-	}
+TidMap::TidMap(int size) : size(size) {
+	slots = new ThreadSlot[size]();
 }
 
 TidMap::~TidMap() {
-	delete[] array;
+	delete[] slots;
 }
 
-int TidMap::getIdFromTid(const int tid) {
-	/* start with a read only lock */
-	ArrayMutex::scoped_lock lock(mutex, false);
-	int i;
-	for (i = 0; i < pos; i++) {
-		if (tid == array[i])
-			return i;
-	}
-	/* the value is not found, add it to the array
-	 * updrade to write lock before modification */
-	if (!lock.upgrade_to_writer()) {
-		/* upgrade_to_write may release the lock for a short period
-		 * of time, check again if another thread already added the value */
-		for (i = 0; i < pos; i++) {
-			if (tid == array[i])
-				return i;
-		}
-	}
-	/*
-	 * write lock is held here and
-	 * the value is not in the array
-	 */
-
-	/* detect full condition */
-	if (pos == size)
+int TidMap::getId() {
+	int id = this_task_arena::current_thread_index();
+	if (id < 0 || id >= size)
 		return -1;
+	/* only the thread of this slot writes it, gettid is called once */
+	if (slots[id].tid == 0)
+		slots[id].tid = gettid();
+	return id;
+}
+
+void TidMap::addBusy(double ms) {
+	int id = getId();
+	if (id < 0)
+		return;
+	slots[id].busy += ms;
+}
 
-	/* append to the array, increase position */
-	int ret = pos;
-	array[pos++] = tid;
-	return ret;
-	/* lock is released automatically */
+void TidMap::countDraw(uint64_t segments, double ms) {
+	int id = getId();
+	if (id < 0)
+		return;
+	slots[id].chunks++;
+	slots[id].segments += segments;
+	slots[id].busy += ms;
 }
 
+void TidMap::countRender(double ms) {
+	int id = getId();
+	if (id < 0)
+		return;
+	slots[id].renderChunks++;
+	slots[id].busy += ms;
+}
+
+/* must not be called while the workers are running */
 void TidMap::dump() {
-	ArrayMutex::scoped_lock lock(mutex, false);
+	uint64_t renderChunks = 0;
 	int i;
+	for (i = 0; i < size; i++)
+		renderChunks += slots[i].renderChunks;
+	cout << "Number of interval: " << renderChunks << endl;
 	cout << "{ ";
 	for (i = 0; i < size; i++) {
-		cout << i << "=" << array[i] << " ";
+		cout << i << "=" << slots[i].tid << " ";
 	}
 	cout << "}\n";
+	for (i = 0; i < size; i++) {
+		if (slots[i].tid == 0)
+			continue;
+		cout << "Thread " << i << " draw chunks: " << slots[i].chunks
+			<< " segments: " << slots[i].segments
+			<< " render chunks: " << slots[i].renderChunks
+			<< " busy: " << slots[i].busy << " milliseconds" << endl;
+	}
 }
+
+/* add the busy time of each slot to the metrics of the run */
+void TidMap::report() {
+	int i;
+	for (i = 0; i < size; i++)
+		metrics_thread(i, slots[i].busy);
+}
+
+#endif /* HAVE_LIBTBB */
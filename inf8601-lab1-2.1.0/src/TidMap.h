@@ -9,25 +9,43 @@
 #define TIDMAP_H_
 
 #include <iostream>
+#include <stdint.h>
 #include "tbb/tbb.h"
 
 using std::ostream;
 using namespace tbb;
 using namespace std;
 
-typedef spin_rw_mutex ArrayMutex;
+/*
+ * Per-thread counters, one cache line each so that threads never write
+ * to the same line.
+ */
+struct alignas(64) ThreadSlot {
+	int tid;
+	uint64_t chunks;
+	uint64_t segments;
+	uint64_t renderChunks;
+	double busy;
+};
 
+/*
+ * Maps the worker threads of the current arena to ids 0..size-1. The id is
+ * the arena slot of the thread, so no lock nor syscall is needed, and each
+ * slot is only written by its own thread.
+ */
 class TidMap {
 private:
 	int size;
-	int pos;
-	int *array;
-	ArrayMutex mutex;
+	ThreadSlot *slots;
 public:
 	TidMap(int size);
 	virtual ~TidMap();
-	int getIdFromTid(const int tid);
+	int getId();
+	void addBusy(double ms);
+	void countDraw(uint64_t segments, double ms);
+	void countRender(double ms);
 	void dump();
+	void report();
 };
 
 #endif /* TIDMAP_H_ */
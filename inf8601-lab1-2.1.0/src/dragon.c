@@ -10,12 +10,24 @@
 
 #define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "dragon.h"
 #include "color.h"
 #include "utils.h"
+#include "scale.h"
+#include "limit.h"
+#include "metrics.h"
+#include "dragon_trace.h"
+
+enum canvas_layout canvas_layout = CANVAS_LINEAR;
+int canvas_packed = 0;
 
 xy_t compute_position(int64_t i)
 {
@@ -57,8 +69,18 @@ xy_t compute_orientation(int64_t i)
 	return orientation;
 }
 
-/* draw dragon in raw matrix */
-int dragon_draw_raw(uint64_t start, uint64_t end, char *dragon, int width, int height, limits_t limits, char id)
+/* turn following the segment n - 1 */
+static inline void draw_turn(uint64_t n, xy_t *orientation)
+{
+	if (((n & -n) << 1) & n)
+		rotate_left(orientation);
+	else
+		rotate_right(orientation);
+}
+
+/* draw dragon in raw matrix, shared when other threads draw other segments in it */
+static int draw_raw(uint64_t start, uint64_t end, char *dragon, int width, int height,
+		limits_t limits, char id, int shared)
 {
 	//printf("start=%" PRId64" end=%"PRId64" id=%d\n", start, end, id);
 	if (end < start)
@@ -69,40 +91,259 @@ int dragon_draw_raw(uint64_t start, uint64_t end, char *dragon, int width, int h
 
 	xy_t position;
 	xy_t orientation;
-	int i, j;
+	int64_t i, j;
 	uint64_t n;
+	int t;
 	position = compute_position(start);
 	orientation = compute_orientation(start);
 
 	// draw dragon
 	position.x -= limits.minimums.x;
 	position.y -= limits.minimums.y;
-	int area = width * height;
-	for (n = start + 1; n <= end; n++) {
+	enum canvas_layout layout = canvas_layout;
+	int packed = canvas_packed ? (shared ? CANVAS_PACKED_SHARED : CANVAS_PACKED) : 0;
+	uint64_t area = canvas_area(width, height);
+	n = start;
+	while (n < end) {
+		/* whole aligned blocks from the table, the other segments one by one */
+		if (!(n & (LIMIT_BLOCK - 1)) && end - n >= LIMIT_BLOCK) {
+			const struct limit_block *block = limit_block_at(n, orientation);
+			if (position.y + block->min_y < 0 || position.x + block->min_x < 0 ||
+					position.y + block->max_y >= height ||
+					position.x + block->max_x >= width) {
+				printf("index is out of range\n");
+				return -1;
+			}
+			if (packed) {
+				for (t = 0; t < LIMIT_BLOCK; t++)
+					canvas_set(packed, dragon, canvas_index(layout, position.y + block->dy[t],
+							position.x + block->dx[t], width), id);
+			} else if (layout == CANVAS_LINEAR) {
+				char *base = dragon + position.y * width + position.x;
+				for (t = 0; t < LIMIT_BLOCK; t++)
+					base[block->dy[t] * (int64_t) width + block->dx[t]] = id;
+			} else {
+				for (t = 0; t < LIMIT_BLOCK; t++)
+					dragon[canvas_index(layout, position.y + block->dy[t],
+							position.x + block->dx[t], width)] = id;
+			}
+			position.x += block->move[0];
+			position.y += block->move[1];
+			orientation = state_orientations[block->state];
+			n += LIMIT_BLOCK;
+			draw_turn(n, &orientation);
+			continue;
+		}
 		j = (position.x + (position.x + orientation.x)) >> 1;
 		i = (position.y + (position.y + orientation.y)) >> 1;
-		int index = i * width + j;
-		if (index < 0 || index > area) {
+		if (i < 0 || j < 0) {
+			printf("index is out of range\n");
+			return -1;
+		}
+		uint64_t index = canvas_index(layout, i, j, width);
+		if (index >= area) {
 			printf("index is out of range\n");
 			return -1;
 		}
-		dragon[index] = id;
+		canvas_set(packed, dragon, index, id);
 		position.x += orientation.x;
 		position.y += orientation.y;
-		if (((n & -n) << 1) & n)
-			rotate_left(&orientation);
-		else
-			rotate_right(&orientation);
+		n++;
+		draw_turn(n, &orientation);
 	}
 	return 0;
 }
 
-void init_canvas(int start, int end, char *canvas, char value)
+int dragon_draw_raw(uint64_t start, uint64_t end, char *dragon, int width, int height, limits_t limits, char id)
 {
-    int i;
-    for (i = start; i < end; i++) {
-        canvas[i] = value;
+	return draw_raw(start, end, dragon, width, height, limits, id, 1);
+}
+
+/* the canvas is drawn by the calling thread only, packed cells need no atomics */
+int dragon_draw_raw_serial(uint64_t start, uint64_t end, char *dragon, int width, int height,
+		limits_t limits, char id)
+{
+	return draw_raw(start, end, dragon, width, height, limits, id, 0);
+}
+
+void init_canvas(uint64_t start, uint64_t end, char *canvas, char value)
+{
+    unsigned char nibble = value & 0xF;
+
+    if (end <= start)
+        return;
+    if (!canvas_packed) {
+        memset(canvas + start, value, end - start);
+        return;
     }
+    /* the bytes shared with the neighbour ranges are set a cell at a time */
+    if (start & 1)
+        canvas_set(CANVAS_PACKED_SHARED, canvas, start++, value);
+    if (end > start && (end & 1))
+        canvas_set(CANVAS_PACKED_SHARED, canvas, --end, value);
+    if (end > start)
+        memset(canvas + (start >> 1), nibble | (nibble << 4), (end - start) >> 1);
+}
+
+/* number of cells to allocate for a canvas in the current layout */
+uint64_t canvas_area(int width, int height)
+{
+	if (canvas_layout == CANVAS_TILED) {
+		uint64_t tiles_x = ((uint64_t) width + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+		uint64_t tiles_y = ((uint64_t) height + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+		return (tiles_x * tiles_y) << (2 * CANVAS_TILE_SHIFT);
+	}
+	return (uint64_t) width * height;
+}
+
+/* bytes holding area cells */
+uint64_t canvas_bytes(uint64_t area)
+{
+	return canvas_packed ? (area + 1) >> 1 : area;
+}
+
+static int canvas_keep = 0;
+static char *canvas_cache = NULL;
+
+uint64_t canvas_memory = 0;
+const char *canvas_dir = ".";
+
+/* mapped canvases, check compares two of them */
+#define CANVAS_MAPS_MAX 4
+
+static struct canvas_map {
+	char *addr;
+	uint64_t length;
+} canvas_maps[CANVAS_MAPS_MAX];
+
+/* canvases of more than area cells do not fit in memory */
+int canvas_mapped(uint64_t area)
+{
+	uint64_t limit = canvas_memory;
+
+	if (limit == 0) {
+		long pages = sysconf(_SC_PHYS_PAGES);
+		long page = sysconf(_SC_PAGESIZE);
+		if (pages <= 0 || page <= 0)
+			return 0;
+		limit = (uint64_t) pages * page / 2;
+	}
+	return canvas_bytes(area) > limit;
+}
+
+/*
+ * Canvas backed by an unlinked file of canvas_dir. The pages are written back
+ * and reclaimed by the kernel, so memory use stays bounded whatever the area.
+ * In the tiled layout a tile is a page, so that the draw pages in one tile at
+ * a time and the clear and the render go through the file in order.
+ */
+static char *canvas_map(uint64_t area)
+{
+	char *path = NULL;
+	char *map = MAP_FAILED;
+	int fd = -1;
+	int k, err;
+
+	for (k = 0; k < CANVAS_MAPS_MAX && canvas_maps[k].addr != NULL; k++)
+		;
+	if (k == CANVAS_MAPS_MAX) {
+		printf("too many mapped canvases\n");
+		return NULL;
+	}
+	if (asprintf(&path, "%s/dragon-canvas-XXXXXX", canvas_dir) < 0)
+		return NULL;
+	if ((fd = mkstemp(path)) < 0) {
+		perror(path);
+		goto done;
+	}
+	unlink(path);
+	/* reserve the blocks now: a full disk would be a SIGBUS in the draw */
+	if ((err = posix_fallocate(fd, 0, area)) != 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(err));
+		goto done;
+	}
+	map = mmap(NULL, area, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		goto done;
+	}
+	canvas_maps[k].addr = map;
+	canvas_maps[k].length = area;
+	printf("Canvas of %"PRIu64" MB mapped in %s\n", area >> 20, canvas_dir);
+
+done:
+	if (fd >= 0)
+		close(fd);
+	FREE(path);
+	return map == MAP_FAILED ? NULL : map;
+}
+
+static int canvas_unmap(char *canvas)
+{
+	int k;
+
+	for (k = 0; k < CANVAS_MAPS_MAX; k++) {
+		if (canvas_maps[k].addr == canvas) {
+			munmap(canvas, canvas_maps[k].length);
+			canvas_maps[k].addr = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * With canvas_reuse(1), canvas_release() keeps the canvas for the next
+ * canvas_alloc() of at most the same size, so that repeated runs do not
+ * measure the allocator and the page faults of a fresh canvas.
+ */
+void canvas_reuse(int enable)
+{
+	canvas_keep = enable;
+	if (!enable)
+		FREE(canvas_cache);
+}
+
+char *canvas_alloc(uint64_t area)
+{
+	char *canvas = canvas_cache;
+	uint64_t bytes = canvas_bytes(area);
+
+	if (canvas_mapped(area))
+		return canvas_map(bytes);
+	if (canvas != NULL && malloc_usable_size(canvas) >= bytes) {
+		canvas_cache = NULL;
+		return canvas;
+	}
+	return (char *) malloc(bytes);
+}
+
+void canvas_release(char *canvas)
+{
+	if (canvas == NULL || canvas_unmap(canvas))
+		return;
+	if (!canvas_keep) {
+		free(canvas);
+		return;
+	}
+	/* keep the largest canvas */
+	if (canvas_cache != NULL && malloc_usable_size(canvas_cache) >= malloc_usable_size(canvas)) {
+		free(canvas);
+		return;
+	}
+	FREE(canvas_cache);
+	canvas_cache = canvas;
+}
+
+const char *canvas_layout_name(enum canvas_layout layout)
+{
+	switch (layout) {
+	case CANVAS_TILED:
+		return "tiled";
+	case CANVAS_LINEAR:
+	default:
+		return "linear";
+	}
 }
 
 void dump_canvas(char *canvas, int width, int height)
@@ -112,7 +353,8 @@ void dump_canvas(char *canvas, int width, int height)
 	printf("width=%d height=%d\n", width, height);
 	for (i = 0; i < width; i++) {
 		for (j = 0; j < height; j++) {
-			printf("%d ", canvas[j * width + i]);
+			printf("%d ", canvas_get(canvas_packed, canvas,
+					canvas_index(canvas_layout, j, i, width)));
 		}
 		printf("\n");
 	}
@@ -135,70 +377,234 @@ void dump_canvas_rgb(struct rgb *canvas, int width, int height)
 void scale_dragon(int start, int end, struct rgb *image, int image_width, int image_height,
         char *dragon, int dragon_width, int dragon_height, struct palette *palette)
 {
-    int i, j, x, y;
-    int scale_x = dragon_width / image_width + 1;
-    int scale_y = dragon_height / image_height + 1;
-    int scale = (scale_x > scale_y ? scale_x : scale_y);
-    int deltaJ = (scale * image_width - dragon_width) / 2;
-    int deltaI = (scale * image_height - dragon_height) / 2;
-    struct rgb *colors = palette->colors;
+    scale_dragon_window(start, end, image, image_width, image_height, dragon, dragon_width,
+            0, 0, dragon_width, dragon_height, palette);
+}
+
+/*
+ * scale_dragon of the dragon_width x dragon_height cells of a canvas of
+ * canvas_width cells wide, from row i0 and column j0
+ */
+void scale_dragon_window(int start, int end, struct rgb *image, int image_width, int image_height,
+        char *dragon, int canvas_width, int64_t i0, int64_t j0, int dragon_width, int dragon_height,
+        struct palette *palette)
+{
+    int64_t i, j;
+    int x, y;
+    int64_t scale_x = dragon_width / image_width + 1;
+    int64_t scale_y = dragon_height / image_height + 1;
+    int64_t scale = (scale_x > scale_y ? scale_x : scale_y);
+    int64_t deltaJ = (scale * image_width - dragon_width) / 2;
+    int64_t deltaI = (scale * image_height - dragon_height) / 2;
+    enum canvas_layout layout = canvas_layout;
+    struct scale_lut lut;
+    box_sum_t box_sum;
+    box_sum_packed_t box_sum_packed = NULL;
+    uint64_t *recip = NULL;
+    int64_t recip_rows = 0;
+
+    scale_lut_init(&lut, palette);
+    box_sum = box_sum_select(&lut);
+    if (canvas_packed)
+        box_sum_packed = box_sum_packed_select(&lut);
+    if ((uint64_t) scale * scale <= SCALE_RECIP_MAX)
+        recip = (uint64_t *) malloc(sizeof(uint64_t) * (scale + 1));
 
     for (y = start; y < end; y++) {
-        int i1 = y * scale - deltaI;
-        int i2 = i1 + scale;
+        int64_t i1 = y * scale - deltaI;
+        int64_t i2 = i1 + scale;
         if (i1 < 0) i1 = 0;
         if (i2 > dragon_height) i2 = dragon_height;
+        /* reciprocals of the cell count, by number of columns */
+        if (recip != NULL && i2 > i1 && i2 - i1 != recip_rows) {
+            recip_rows = i2 - i1;
+            for (j = 1; j <= scale; j++)
+                recip[j] = scale_recip(recip_rows * j);
+        }
         for (x = 0; x < image_width; x++) {
-            int j1 = x * scale - deltaJ, j2 = j1 + scale;
-            int red = 0;
-            int green = 0;
-            int blue = 0;
-            int cnt = 0;
+            int64_t j1 = x * scale - deltaJ, j2 = j1 + scale;
+            int64_t sums[3] = { 0, 0, 0 };
+            int64_t cnt = 0;
             if (j1 < 0) j1 = 0;
             if (j2 > dragon_width) j2 = dragon_width;
-            for (i = i1; i < i2; i++) {
-                for (j = j1; j < j2; j++) {
-                    int id = dragon[i * dragon_width + j];
-                    if (id >= 0) {
-                        red     += colors[id].r;
-                        green   += colors[id].g;
-                        blue    += colors[id].b;
-                    } else {
-                        red     += 255;
-                        green   += 255;
-                        blue    += 255;
+            if (i2 > i1 && j2 > j1) {
+                cnt = (int64_t) (i2 - i1) * (j2 - j1);
+                if (layout == CANVAS_TILED) {
+                    /* the box is contiguous by rows inside each tile */
+                    int64_t ni, nj;
+                    for (i = i1; i < i2; i = ni) {
+                        ni = ((i + i0) | CANVAS_TILE_MASK) + 1 - i0;
+                        if (ni > i2) ni = i2;
+                        for (j = j1; j < j2; j = nj) {
+                            nj = ((j + j0) | CANVAS_TILE_MASK) + 1 - j0;
+                            if (nj > j2) nj = j2;
+                            uint64_t cell = canvas_index(layout, i + i0, j + j0, canvas_width);
+                            if (box_sum_packed != NULL)
+                                box_sum_packed(dragon, cell, CANVAS_TILE, ni - i, nj - j, &lut, sums);
+                            else
+                                box_sum(&dragon[cell], CANVAS_TILE, ni - i, nj - j, &lut, sums);
+                        }
                     }
-                    cnt++;
+                } else {
+                    uint64_t cell = canvas_index(layout, i1 + i0, j1 + j0, canvas_width);
+                    if (box_sum_packed != NULL)
+                        box_sum_packed(dragon, cell, canvas_width, i2 - i1, j2 - j1, &lut, sums);
+                    else
+                        box_sum(&dragon[cell], canvas_width, i2 - i1, j2 - j1, &lut, sums);
                 }
             }
             int index = y * image_width + x;
             if (cnt == 0) {
                 image[index] = white;
+            } else if (recip != NULL) {
+                image[index].r = scale_div(sums[0], recip[j2 - j1]);
+                image[index].g = scale_div(sums[1], recip[j2 - j1]);
+                image[index].b = scale_div(sums[2], recip[j2 - j1]);
             } else {
-                image[index].r = (unsigned char) (red   / cnt);
-                image[index].g = (unsigned char) (green / cnt);
-                image[index].b = (unsigned char) (blue  / cnt);
+                image[index].r = (unsigned char) (sums[0] / cnt);
+                image[index].g = (unsigned char) (sums[1] / cnt);
+                image[index].b = (unsigned char) (sums[2] / cnt);
             }
         }
     }
+    FREE(recip);
 }
 
-int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+/*
+ * draw dragon directly in the accumulators of the scaled image
+ *
+ * sums holds, for each image pixel, the difference between the summed colors
+ * of its drawn cells and white. A cell is crossed by at most one segment, so
+ * no occupancy is required to get the same result as scale_dragon.
+ */
+int dragon_draw_scaled(uint64_t start, uint64_t end, int64_t *sums, int image_width, int image_height,
+		int dragon_width, int dragon_height, limits_t limits, struct rgb color)
+{
+	if (end < start)
+		printf("error: start=%"PRId64" > end=%"PRId64"\n", start, end);
+
+	if (end == start)
+		return 0;
+
+	xy_t position;
+	xy_t orientation;
+	int64_t i, j;
+	int t;
+	uint64_t n;
+	int64_t scale_x = dragon_width / image_width + 1;
+	int64_t scale_y = dragon_height / image_height + 1;
+	int64_t scale = (scale_x > scale_y ? scale_x : scale_y);
+	int64_t deltaJ = (scale * image_width - dragon_width) / 2;
+	int64_t deltaI = (scale * image_height - dragon_height) / 2;
+	int narrow = scale_narrow(scale, image_width, image_height);
+	int64_t red = (int64_t) color.r - 255;
+	int64_t green = (int64_t) color.g - 255;
+	int64_t blue = (int64_t) color.b - 255;
+	position = compute_position(start);
+	orientation = compute_orientation(start);
+
+	position.x -= limits.minimums.x;
+	position.y -= limits.minimums.y;
+	n = start;
+	while (n < end) {
+		/* whole aligned blocks from the table, as in dragon_draw_raw */
+		if (!(n & (LIMIT_BLOCK - 1)) && end - n >= LIMIT_BLOCK) {
+			const struct limit_block *block = limit_block_at(n, orientation);
+			if (position.y + block->min_y < 0 || position.x + block->min_x < 0 ||
+					position.y + block->max_y >= dragon_height ||
+					position.x + block->max_x >= dragon_width) {
+				printf("index is out of range\n");
+				return -1;
+			}
+			for (t = 0; t < LIMIT_BLOCK; t++) {
+				i = position.y + block->dy[t];
+				j = position.x + block->dx[t];
+				int64_t *sum = &sums[3 * (scale_cell(i + deltaI, scale, narrow) * image_width +
+						scale_cell(j + deltaJ, scale, narrow))];
+				sum[0] += red;
+				sum[1] += green;
+				sum[2] += blue;
+			}
+			position.x += block->move[0];
+			position.y += block->move[1];
+			orientation = state_orientations[block->state];
+			n += LIMIT_BLOCK;
+			draw_turn(n, &orientation);
+			continue;
+		}
+		j = (position.x + (position.x + orientation.x)) >> 1;
+		i = (position.y + (position.y + orientation.y)) >> 1;
+		if (i < 0 || i >= dragon_height || j < 0 || j >= dragon_width) {
+			printf("index is out of range\n");
+			return -1;
+		}
+		int64_t *sum = &sums[3 * (scale_cell(i + deltaI, scale, narrow) * image_width +
+				scale_cell(j + deltaJ, scale, narrow))];
+		sum[0] += red;
+		sum[1] += green;
+		sum[2] += blue;
+		position.x += orientation.x;
+		position.y += orientation.y;
+		n++;
+		draw_turn(n, &orientation);
+	}
+	return 0;
+}
+
+/* same as scale_dragon, from the accumulators filled by dragon_draw_scaled */
+void scale_sums(int start, int end, struct rgb *image, int image_width, int image_height,
+        int64_t *sums, int dragon_width, int dragon_height)
+{
+    int x, y;
+    int64_t scale_x = dragon_width / image_width + 1;
+    int64_t scale_y = dragon_height / image_height + 1;
+    int64_t scale = (scale_x > scale_y ? scale_x : scale_y);
+    int64_t deltaJ = (scale * image_width - dragon_width) / 2;
+    int64_t deltaI = (scale * image_height - dragon_height) / 2;
+
+    for (y = start; y < end; y++) {
+        int64_t i1 = y * scale - deltaI;
+        int64_t i2 = i1 + scale;
+        if (i1 < 0) i1 = 0;
+        if (i2 > dragon_height) i2 = dragon_height;
+        for (x = 0; x < image_width; x++) {
+            int64_t j1 = x * scale - deltaJ, j2 = j1 + scale;
+            if (j1 < 0) j1 = 0;
+            if (j2 > dragon_width) j2 = dragon_width;
+            int index = y * image_width + x;
+            int64_t cnt = 0;
+            if (i2 > i1 && j2 > j1)
+                cnt = (int64_t) (i2 - i1) * (j2 - j1);
+            if (cnt == 0) {
+                image[index] = white;
+            } else {
+                int64_t *sum = &sums[3 * index];
+                image[index].r = (unsigned char) ((255 * cnt + sum[0]) / cnt);
+                image[index].g = (unsigned char) ((255 * cnt + sum[1]) / cnt);
+                image[index].b = (unsigned char) ((255 * cnt + sum[2]) / cnt);
+            }
+        }
+    }
+}
+
+static int dragon_draw_sequential(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors,
+		int (*limits_handler)(limits_t *, uint64_t, int))
 {
 	int ret = 0;
 	char *dragon = NULL;
 	struct palette *palette = NULL;
 	limits_t limits;
 
-	if (dragon_limits_serial(&limits, size, 0) < 0)
+	if (limits_handler(&limits, size, 0) < 0)
 		goto err;
 
 	int dragon_width = limits.maximums.x - limits.minimums.x;
 	int dragon_height = limits.maximums.y - limits.minimums.y;
-	int area = dragon_width * dragon_height;
+	uint64_t area = canvas_area(dragon_width, dragon_height);
 	int m;
+	double begin, work = 0, ms;
 
-	dragon = (char*)malloc(sizeof(char) * area);
+	dragon = canvas_alloc(area);
 	if (dragon == NULL)
 		goto err;
 
@@ -207,17 +613,43 @@ int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height,
 		goto err;
 
 	// clear dragon
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+	TRACE_WORK_BEGIN(METRICS_CLEAR, 0, area);
 	init_canvas(0, area, dragon, -1);
+	TRACE_WORK_END(METRICS_CLEAR, 0, area);
+	TRACE_PHASE_END(METRICS_CLEAR);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_CLEAR, ms);
+	work += ms;
 
 	// Draw dragon
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
 	for (m = 0; m < nb_colors; m++) {
-		uint64_t start = m * size / nb_colors;
-		uint64_t end = (m + 1) * size / nb_colors;
-		dragon_draw_raw(start, end, dragon, dragon_width, dragon_height, limits, m);
+		uint64_t start = range_part(size, m, nb_colors);
+		uint64_t end = range_part(size, m + 1, nb_colors);
+		TRACE_WORK_BEGIN(METRICS_DRAW, start, end);
+		dragon_draw_raw_serial(start, end, dragon, dragon_width, dragon_height, limits, m);
+		TRACE_WORK_END(METRICS_DRAW, start, end);
 	}
+	TRACE_PHASE_END(METRICS_DRAW);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_DRAW, ms);
+	work += ms;
+	printf("Draw calcul time (%s): %d milliseconds\n", canvas_layout_name(canvas_layout),
+			(int) ms);
 
 	// Scale dragon to fit the final image
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+	TRACE_WORK_BEGIN(METRICS_RENDER, 0, height);
 	scale_dragon(0, height, image, width, height, dragon, dragon_width, dragon_height, palette);
+	TRACE_WORK_END(METRICS_RENDER, 0, height);
+	TRACE_PHASE_END(METRICS_RENDER);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_RENDER, ms);
+	metrics_thread(0, work + ms);
 
 done:
 	free_palette(palette);
@@ -225,11 +657,96 @@ done:
 	return ret;
 
 err:
-	FREE(dragon);
+	canvas_release(dragon);
+	dragon = NULL;
 	ret = -1;
 	goto done;
 }
 
+int dragon_draw_serial(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+{
+	return dragon_draw_sequential(canvas, image, width, height, size, nb_colors, dragon_limits_serial);
+}
+
+int dragon_draw_table(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+{
+	return dragon_draw_sequential(canvas, image, width, height, size, nb_colors, dragon_limits_table);
+}
+
+/*
+ * Draw and scale in a single pass, without allocating the dragon canvas.
+ * Memory usage depends only on the image size.
+ */
+int dragon_draw_stream(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+{
+	int ret = 0;
+	int64_t *sums = NULL;
+	struct palette *palette = NULL;
+	limits_t limits;
+	double begin, work = 0, ms;
+	int m;
+
+	if (dragon_limits_table(&limits, size, 0) < 0)
+		goto err;
+
+	int dragon_width = limits.maximums.x - limits.minimums.x;
+	int dragon_height = limits.maximums.y - limits.minimums.y;
+
+	begin = metrics_now();
+	sums = (int64_t *) calloc(3 * width * height, sizeof(int64_t));
+	if (sums == NULL)
+		goto err;
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_CLEAR, ms);
+	work += ms;
+
+	palette = init_palette(nb_colors);
+	if (palette == NULL)
+		goto err;
+
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+	for (m = 0; m < nb_colors; m++) {
+		uint64_t start = range_part(size, m, nb_colors);
+		uint64_t end = range_part(size, m + 1, nb_colors);
+		TRACE_WORK_BEGIN(METRICS_DRAW, start, end);
+		if (dragon_draw_scaled(start, end, sums, width, height, dragon_width, dragon_height,
+				limits, palette->colors[m]) < 0)
+			goto err;
+		TRACE_WORK_END(METRICS_DRAW, start, end);
+	}
+	TRACE_PHASE_END(METRICS_DRAW);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_DRAW, ms);
+	work += ms;
+
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+	TRACE_WORK_BEGIN(METRICS_RENDER, 0, height);
+	scale_sums(0, height, image, width, height, sums, dragon_width, dragon_height);
+	TRACE_WORK_END(METRICS_RENDER, 0, height);
+	TRACE_PHASE_END(METRICS_RENDER);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_RENDER, ms);
+	metrics_thread(0, work + ms);
+
+done:
+	free_palette(palette);
+	FREE(sums);
+	*canvas = NULL;
+	return ret;
+
+err:
+	ret = -1;
+	goto done;
+}
+
+/* length of the PPM header of the images */
+static int ppm_header(char *buf, size_t len, int width, int height)
+{
+	return snprintf(buf, len, "P6\n%d %d\n%d\n", width, height, 255);
+}
+
 int write_img(struct rgb *image, char *file, int width, int height)
 {
 	FILE *f = NULL;
@@ -248,8 +765,10 @@ int write_img(struct rgb *image, char *file, int width, int height)
 		}
 	}
 
-	fprintf(f, "P6\n%d %d\n%d\n", width, height, 255);
-	fwrite(image, sizeof(struct rgb), width * height, f);
+	char header[64];
+	ppm_header(header, sizeof(header), width, height);
+	fputs(header, f);
+	fwrite(image, sizeof(struct rgb), (size_t) width * height, f);
 	fclose(f);
 	return 0;
 }
@@ -274,6 +793,32 @@ int cmp_limits(limits_t *l1, limits_t *l2)
 		l2->minimums.x == l2->minimums.x &&
 		l1->minimums.y == l2->minimums.y);
 }
+/*
+ * compare each pixel exp(i,j) with act(i,j)
+ * return the number of pixels that doesn't match
+ */
+int cmp_image(struct rgb *exp, struct rgb *act, int width, int height, int verbose)
+{
+	int i, j;
+	int sum = 0;
+	int index;
+	if (exp == NULL || act == NULL)
+		return -1;
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width; j++) {
+			index = i * width + j;
+			if (exp[index].r != act[index].r ||
+				exp[index].g != act[index].g ||
+				exp[index].b != act[index].b) {
+				if (verbose)
+					printf("pix error (%5d, %5d)\n", j, i);
+				sum += 1;
+			}
+		}
+	}
+	return sum;
+}
+
 /*
  * compare each position exp(i,j) with act(i,j)
  * return the number of pixels that doesn't match
@@ -282,16 +827,19 @@ int cmp_canvas(char *exp, char *act, int width, int height, int verbose)
 {
 	int i, j;
 	int sum = 0;
-	int index;
+	uint64_t index;
+	enum canvas_layout layout = canvas_layout;
+	int packed = canvas_packed;
 	if (exp == NULL || act == NULL)
 		return -1;
 	#pragma omp parallel for reduction(+:sum) private(index, j)
 	for (i = 0; i < height; i++) {
 		for (j = 0; j < width; j++) {
-			index = i * width + j;
-			if (exp[index] != act[index]) {
+			index = canvas_index(layout, i, j, width);
+			char e = canvas_get(packed, exp, index), a = canvas_get(packed, act, index);
+			if (e != a) {
 				if (verbose)
-					printf("pix error (%5d, %5d) expected=%2d actual=%2d\n", j, i, exp[index], act[index]);
+					printf("pix error (%5d, %5d) expected=%2d actual=%2d\n", j, i, e, a);
 				sum += 1;
 			}
 		}
@@ -299,6 +847,38 @@ int cmp_canvas(char *exp, char *act, int width, int height, int verbose)
 	return sum;
 }
 
+/*
+ * FNV-1a hash of the cell ids of the canvas, in row-major order whatever the
+ * layout and the packing. A cell is crossed by a single segment, so the ids
+ * only depend on the size and the number of colors.
+ */
+uint64_t canvas_hash(char *canvas, int width, int height)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	int i, j;
+	for (i = 0; i < height; i++) {
+		for (j = 0; j < width; j++) {
+			hash ^= (unsigned char) canvas_get(canvas_packed, canvas,
+					canvas_index(canvas_layout, i, j, width));
+			hash *= 0x100000001b3ULL;
+		}
+	}
+	return hash;
+}
+
+/* same as canvas_hash, for the colors of the pixels of the image */
+uint64_t image_hash(struct rgb *image, int width, int height)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const unsigned char *bytes = (const unsigned char *) image;
+	uint64_t i;
+	for (i = 0; i < sizeof(struct rgb) * width * height; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 void piece_init(piece_t *piece)
 {
 	if (piece == NULL)
@@ -314,24 +894,352 @@ void piece_init(piece_t *piece)
 int dragon_limits_serial(limits_t *lim, uint64_t nbIterations, __attribute__((unused)) int nb_thread)
 {
 	piece_t piece;
+	double begin = metrics_now();
 	piece_init(&piece);
 	uint64_t start = 0;
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, nbIterations);
+	TRACE_WORK_BEGIN(METRICS_LIMITS, start, nbIterations);
 	piece_limit(start, nbIterations, &piece);
+	TRACE_WORK_END(METRICS_LIMITS, start, nbIterations);
+	TRACE_PHASE_END(METRICS_LIMITS);
 	*lim = piece.limits;
+	metrics_phase(METRICS_LIMITS, metrics_now() - begin);
 	return 0;
 }
 
+/*
+ * Table of pieces per power of two. table[k][b] is the piece of an aligned
+ * block of 2^k segments, without the turn following its last segment. The
+ * middle turn of the block depends on the bit k of its start, hence b.
+ *
+ * table[k+1][b] = table[k][0] + turn(b) + table[k][1]
+ */
+static void piece_table_init(piece_t table[][2], int power)
+{
+	int k, b;
+
+	piece_init(&table[0][0]);
+	table[0][0].position = table[0][0].orientation;
+	table[0][0].limits.maximums = table[0][0].position;
+	table[0][1] = table[0][0];
+
+	for (k = 0; k < power; k++) {
+		for (b = 0; b < 2; b++) {
+			table[k + 1][b] = table[k][0];
+			if (b)
+				rotate_left(&table[k + 1][b].orientation);
+			else
+				rotate_right(&table[k + 1][b].orientation);
+			piece_merge(&table[k + 1][b], table[k][1]);
+		}
+	}
+}
+
+/*
+ * Same result as piece_limit(start, end, m) in O(log(end - start)), by
+ * composing aligned blocks of 2^k segments taken from the piece table.
+ */
+void piece_range(uint64_t start, uint64_t end, piece_t *m)
+{
+	piece_t table[64][2];
+	piece_t block;
+	uint64_t n;
+	int power = 0;
+	int k;
+
+	if (end <= start)
+		return;
+
+	while (power < 63 && (1ULL << (power + 1)) <= end - start)
+		power++;
+	piece_table_init(table, power);
+
+	while (start < end) {
+		k = 0;
+		while (k < power && !(start & (1ULL << k)) &&
+				start + (1ULL << (k + 1)) <= end)
+			k++;
+		block = table[k][(start >> k) & 1];
+		n = start + (1ULL << k);
+		if (((n & -n) << 1) & n)
+			rotate_left(&block.orientation);
+		else
+			rotate_right(&block.orientation);
+		piece_merge(m, block);
+		start = n;
+	}
+}
+
+int dragon_limits_table(limits_t *lim, uint64_t nbIterations, __attribute__((unused)) int nb_thread)
+{
+	piece_t piece;
+	double begin = metrics_now();
+	piece_init(&piece);
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, nbIterations);
+	TRACE_WORK_BEGIN(METRICS_LIMITS, 0, nbIterations);
+	piece_range(0, nbIterations, &piece);
+	TRACE_WORK_END(METRICS_LIMITS, 0, nbIterations);
+	TRACE_PHASE_END(METRICS_LIMITS);
+	*lim = piece.limits;
+	metrics_phase(METRICS_LIMITS, metrics_now() - begin);
+	return 0;
+}
+
+/*
+ * Clip the viewport, in cells from the top left corner of the dragon, to
+ * the dragon of width x height cells. Returns -1 if nothing is left.
+ */
+int viewport_clip(limits_t *viewport, int64_t width, int64_t height)
+{
+	if (viewport->minimums.x < 0)
+		viewport->minimums.x = 0;
+	if (viewport->minimums.y < 0)
+		viewport->minimums.y = 0;
+	if (viewport->maximums.x > width)
+		viewport->maximums.x = width;
+	if (viewport->maximums.y > height)
+		viewport->maximums.y = height;
+	if (viewport->minimums.x >= viewport->maximums.x ||
+			viewport->minimums.y >= viewport->maximums.y)
+		return -1;
+	return 0;
+}
+
+/* blocks of up to 2^VIEWPORT_LEAF_SHIFT segments are drawn without culling */
+#define VIEWPORT_LEAF_SHIFT	8
+
+struct viewport_draw {
+	piece_t table[64][2];
+	char *canvas;
+	int width;
+	int height;
+	/* viewport in positions of the dragon */
+	limits_t cells;
+	uint64_t size;
+	int nb_colors;
+	int color;
+	uint64_t color_end;
+	uint64_t visited;
+};
+
+/* segments [start, end) from position, orientation, clipped to the viewport */
+static void viewport_segments(struct viewport_draw *vp, uint64_t start, uint64_t end,
+		xy_t position, xy_t orientation)
+{
+	enum canvas_layout layout = canvas_layout;
+	int packed = canvas_packed;
+	int64_t i, j;
+	uint64_t n;
+
+	vp->visited += end - start;
+	for (n = start + 1; n <= end; n++) {
+		while (n > vp->color_end) {
+			vp->color++;
+			vp->color_end = range_part(vp->size, vp->color + 1, vp->nb_colors);
+		}
+		j = ((position.x + (position.x + orientation.x)) >> 1) - vp->cells.minimums.x;
+		i = ((position.y + (position.y + orientation.y)) >> 1) - vp->cells.minimums.y;
+		if (i >= 0 && i < vp->height && j >= 0 && j < vp->width)
+			canvas_set(packed, vp->canvas, canvas_index(layout, i, j, vp->width), vp->color);
+		position.x += orientation.x;
+		position.y += orientation.y;
+		if (((n & -n) << 1) & n)
+			rotate_left(&orientation);
+		else
+			rotate_right(&orientation);
+	}
+}
+
+/*
+ * Aligned block of 2^k segments from start, cursor being the position and
+ * orientation of its first segment. The box of the block, from the piece
+ * table, is tested against the viewport: outside, the block is skipped in
+ * O(1), otherwise its halves are tested in turn. cursor moves past the block.
+ */
+static void viewport_block(struct viewport_draw *vp, uint64_t start, int k, piece_t *cursor)
+{
+	piece_t box = *cursor;
+	uint64_t n = start + (1ULL << k);
+
+	box.limits.minimums = box.position;
+	box.limits.maximums = box.position;
+	piece_merge(&box, vp->table[k][(start >> k) & 1]);
+
+	/* the cells of the segments are inside [minimums, maximums) */
+	if (box.limits.minimums.x < vp->cells.maximums.x &&
+			box.limits.maximums.x > vp->cells.minimums.x &&
+			box.limits.minimums.y < vp->cells.maximums.y &&
+			box.limits.maximums.y > vp->cells.minimums.y) {
+		if (k > VIEWPORT_LEAF_SHIFT) {
+			viewport_block(vp, start, k - 1, cursor);
+			viewport_block(vp, start + (1ULL << (k - 1)), k - 1, cursor);
+			return;
+		}
+		viewport_segments(vp, start, n, cursor->position, cursor->orientation);
+	}
+	if (((n & -n) << 1) & n)
+		rotate_left(&box.orientation);
+	else
+		rotate_right(&box.orientation);
+	cursor->position = box.position;
+	cursor->orientation = box.orientation;
+}
+
+/*
+ * Draw only the viewport of the dragon at full resolution, one cell per
+ * segment, in a canvas of the size of the viewport. The cost depends on
+ * the visible segments rather than on the size of the dragon.
+ */
+int dragon_draw_viewport(char **canvas, struct rgb *image, int width, int height, uint64_t size,
+		int nb_colors, limits_t *viewport)
+{
+	int ret = 0;
+	struct viewport_draw *vp = NULL;
+	struct palette *palette = NULL;
+	char *dragon = NULL;
+	limits_t limits, clip = *viewport;
+	piece_t cursor;
+	uint64_t start, area;
+	double begin, work = 0, ms;
+	int k;
+
+	if (dragon_limits_table(&limits, size, 0) < 0)
+		goto err;
+	if (viewport_clip(&clip, limits.maximums.x - limits.minimums.x,
+			limits.maximums.y - limits.minimums.y) < 0) {
+		printf("The viewport is outside of the dragon\n");
+		goto err;
+	}
+
+	vp = (struct viewport_draw *) calloc(1, sizeof(struct viewport_draw));
+	if (vp == NULL)
+		goto err;
+	vp->width = clip.maximums.x - clip.minimums.x;
+	vp->height = clip.maximums.y - clip.minimums.y;
+	vp->cells.minimums.x = limits.minimums.x + clip.minimums.x;
+	vp->cells.minimums.y = limits.minimums.y + clip.minimums.y;
+	vp->cells.maximums.x = limits.minimums.x + clip.maximums.x;
+	vp->cells.maximums.y = limits.minimums.y + clip.maximums.y;
+	vp->size = size;
+	vp->nb_colors = nb_colors;
+	vp->color_end = range_part(size, 1, nb_colors);
+	area = canvas_area(vp->width, vp->height);
+
+	palette = init_palette(nb_colors);
+	if (palette == NULL)
+		goto err;
+
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+	dragon = canvas_alloc(area);
+	if (dragon == NULL)
+		goto err;
+	init_canvas(0, area, dragon, -1);
+	TRACE_PHASE_END(METRICS_CLEAR);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_CLEAR, ms);
+	work += ms;
+	vp->canvas = dragon;
+
+	/* same aligned blocks as piece_range, each one culled against the viewport */
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+	for (k = 0; k < 63 && (1ULL << (k + 1)) <= size; k++)
+		;
+	piece_table_init(vp->table, k);
+	piece_init(&cursor);
+	for (start = 0; start < size; start += 1ULL << k) {
+		k = 0;
+		while (!(start & (1ULL << k)) && start + (1ULL << (k + 1)) <= size)
+			k++;
+		viewport_block(vp, start, k, &cursor);
+	}
+	TRACE_PHASE_END(METRICS_DRAW);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_DRAW, ms);
+	work += ms;
+	printf("Draw calcul time (viewport %dx%d): %d milliseconds, %"PRIu64" of %"PRIu64
+			" segments visited\n", vp->width, vp->height, (int) ms, vp->visited, size);
+
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+	scale_dragon(0, height, image, width, height, dragon, vp->width, vp->height, palette);
+	TRACE_PHASE_END(METRICS_RENDER);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_RENDER, ms);
+	metrics_thread(0, work + ms);
+
+done:
+	free_palette(palette);
+	FREE(vp);
+	*canvas = dragon;
+	return ret;
+
+err:
+	canvas_release(dragon);
+	dragon = NULL;
+	ret = -1;
+	goto done;
+}
+
 struct rgb *make_canvas(int width, int height)
 {
-	int area;
-	area = height * width;
+	int64_t area;
+	area = (int64_t) height * width;
 	if (area <= 0) {
 		return NULL;
 	}
 	return (struct rgb *) malloc(sizeof(struct rgb) * area);
 }
 
-void piece_limit(int64_t start, int64_t end, piece_t *m)
+/*
+ * Image mapped in the PPM file, after its header: the pixels rendered in the
+ * image are written to the file by the kernel, without write_img. Release
+ * with free_canvas_mapped.
+ */
+struct rgb *make_canvas_mapped(char *file, int width, int height)
+{
+	char header[64];
+	size_t length;
+	char *map;
+	int fd;
+	int n;
+
+	if (file == NULL || width <= 0 || height <= 0)
+		return NULL;
+	n = ppm_header(header, sizeof(header), width, height);
+	length = n + sizeof(struct rgb) * width * height;
+	if ((fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(file);
+		return NULL;
+	}
+	if (ftruncate(fd, length) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	memcpy(map, header, n);
+	return (struct rgb *) (map + n);
+}
+
+int free_canvas_mapped(struct rgb *image, int width, int height)
+{
+	char header[64];
+	int n;
+
+	if (image == NULL)
+		return -1;
+	n = ppm_header(header, sizeof(header), width, height);
+	return munmap((char *) image - n, n + sizeof(struct rgb) * width * height);
+}
+
+static void piece_limit_segments(int64_t start, int64_t end, piece_t *m)
 {
 	int64_t n;
 	xy_t *position = &m->position;
@@ -352,6 +1260,21 @@ void piece_limit(int64_t start, int64_t end, piece_t *m)
 		if (maximums->y < position->y) maximums->y = position->y;
 	}
 }
+
+/* the aligned blocks of segments are done by the kernel of the CPU */
+void piece_limit(int64_t start, int64_t end, piece_t *m)
+{
+	int64_t head = (start + LIMIT_BLOCK - 1) & ~(int64_t) (LIMIT_BLOCK - 1);
+	int64_t tail = end & ~(int64_t) (LIMIT_BLOCK - 1);
+
+	if (head >= tail) {
+		piece_limit_segments(start, end, m);
+		return;
+	}
+	piece_limit_segments(start, head, m);
+	limit_blocks(head, tail, m);
+	piece_limit_segments(tail, end, m);
+}
 /*
  * merge m2 into m1
  * This operation is associative, but not commutative
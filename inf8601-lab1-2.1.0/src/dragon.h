@@ -46,6 +46,108 @@ typedef struct morceau_ {
 	limits_t	limits;
 } piece_t;
 
+/*
+ * Memory layout of the dragon canvas
+ *
+ * CANVAS_LINEAR is row-major. CANVAS_TILED splits the canvas in square tiles
+ * of CANVAS_TILE x CANVAS_TILE cells, row-major inside each tile, so that
+ * neighbour cells of the curve stay in the same page.
+ */
+enum canvas_layout {
+	CANVAS_LINEAR,
+	CANVAS_TILED,
+};
+
+#define CANVAS_TILE_SHIFT	6
+#define CANVAS_TILE			(1 << CANVAS_TILE_SHIFT)
+#define CANVAS_TILE_MASK	(CANVAS_TILE - 1)
+
+extern enum canvas_layout canvas_layout;
+
+/*
+ * Packed canvases hold two cells per byte, the even cell in the low nibble,
+ * for up to CANVAS_PACKED_COLORS colors, the nibble CANVAS_PACKED_EMPTY
+ * being the empty cell -1. Indexes stay in cells, canvas_bytes() gives the
+ * size of the allocation. When several threads draw the canvas, two of them
+ * may draw the two cells of a byte: canvas_set() in CANVAS_PACKED_SHARED
+ * updates it with a compare and swap, in CANVAS_PACKED with a plain store.
+ */
+#define CANVAS_PACKED_COLORS	15
+#define CANVAS_PACKED_EMPTY		0xF
+#define CANVAS_PACKED			1
+#define CANVAS_PACKED_SHARED	2
+
+extern int canvas_packed;
+
+static inline char canvas_get(int packed, const char *canvas, uint64_t index)
+{
+	if (packed) {
+		int id = ((unsigned char) canvas[index >> 1] >> ((index & 1) << 2)) & 0xF;
+		return id == CANVAS_PACKED_EMPTY ? -1 : id;
+	}
+	return canvas[index];
+}
+
+static inline void canvas_set(int packed, char *canvas, uint64_t index, char id)
+{
+	if (packed) {
+		unsigned char *byte = (unsigned char *) &canvas[index >> 1];
+		int shift = (index & 1) << 2;
+		unsigned char mask = 0xF << shift;
+		unsigned char cell = ((unsigned char) id & 0xF) << shift;
+		unsigned char old = __atomic_load_n(byte, __ATOMIC_RELAXED);
+		if (packed != CANVAS_PACKED_SHARED) {
+			*byte = (old & ~mask) | cell;
+			return;
+		}
+		while (!__atomic_compare_exchange_n(byte, &old, (unsigned char) ((old & ~mask) | cell),
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+		return;
+	}
+	canvas[index] = id;
+}
+
+static inline uint64_t canvas_index(enum canvas_layout layout, int64_t i, int64_t j, int width)
+{
+	if (layout == CANVAS_TILED) {
+		uint64_t tiles_x = ((uint64_t) width + CANVAS_TILE_MASK) >> CANVAS_TILE_SHIFT;
+		uint64_t tile = (i >> CANVAS_TILE_SHIFT) * tiles_x + (j >> CANVAS_TILE_SHIFT);
+		return (tile << (2 * CANVAS_TILE_SHIFT)) +
+				((i & CANVAS_TILE_MASK) << CANVAS_TILE_SHIFT) + (j & CANVAS_TILE_MASK);
+	}
+	return (uint64_t) i * width + j;
+}
+
+/*
+ * Pixel of the scaled image holding the row or column k of the dragon, with a
+ * 32 bits division when narrow: the dragon only exceeds 32 bits near
+ * POWER_MAX, and a 64 bits division per cell slows the draw down by a third.
+ */
+static inline int64_t scale_cell(int64_t k, int64_t scale, int narrow)
+{
+	return narrow ? (int64_t) ((uint32_t) k / (uint32_t) scale) : k / scale;
+}
+
+/* scaled dragon of scale * image_width x scale * image_height cells in 32 bits */
+static inline int scale_narrow(int64_t scale, int image_width, int image_height)
+{
+	return scale * image_width <= UINT32_MAX && scale * image_height <= UINT32_MAX;
+}
+
+/* k * size / n, without overflowing 64 bits for large dragons */
+static inline uint64_t range_part(uint64_t size, uint64_t k, uint64_t n)
+{
+	return (size / n) * k + (size % n) * k / n;
+}
+
+/*
+ * Canvases larger than canvas_memory bytes are mapped from a file created in
+ * canvas_dir. canvas_memory 0 is half of the physical memory.
+ */
+extern uint64_t canvas_memory;
+extern const char *canvas_dir;
+
 struct draw_data {
 	int id;
 	int nb_thread;
@@ -53,15 +155,14 @@ struct draw_data {
 	int dragon_height;
 	int image_width;
 	int image_height;
-	int scale;
-	int deltaI;
-	int deltaJ;
+	int64_t scale;
+	int64_t deltaI;
+	int64_t deltaJ;
 	struct rgb *image;
 	struct palette *palette;
 	char *dragon;
 	uint64_t size;
 	limits_t limits;
-	pthread_barrier_t *barrier;
 } __attribute__((aligned(128)));
 
 struct limit_data {
@@ -69,12 +170,21 @@ struct limit_data {
 	uint64_t start;
 	uint64_t end;
 	piece_t piece;
+	double busy;
 } __attribute__((aligned(128)));
 
+/*
+ * called by the sweeps after the dragon of each power, which may give
+ * another image to render the next power in
+ */
+typedef int (*dragon_frame)(int power, struct rgb **image, void *arg);
+
 int dragon_limits_serial(limits_t *limits, uint64_t nbIterations, int nb_thread);
+int dragon_limits_table(limits_t *limits, uint64_t nbIterations, int nb_thread);
 void dump_limits(limits_t *limits);
 int cmp_limits(limits_t *l1, limits_t *l2);
 void piece_limit(int64_t debut, int64_t fin, piece_t *m);
+void piece_range(uint64_t start, uint64_t end, piece_t *m);
 void piece_merge(piece_t *m1, piece_t m2);
 void piece_init(piece_t *piece);
 void rotate_left(xy_t *xy);
@@ -83,14 +193,40 @@ void limits_invert(limits_t *limites);
 xy_t compute_position(int64_t i);
 xy_t compute_orientation(int64_t i);
 int dragon_draw_serial(char **dragon, struct rgb *image, int width, int height, uint64_t size, __attribute__((unused)) int nb_thread);
+int dragon_draw_table(char **dragon, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_draw_stream(char **dragon, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_draw_viewport(char **canvas, struct rgb *image, int width, int height, uint64_t size,
+		int nb_colors, limits_t *viewport);
+int viewport_clip(limits_t *viewport, int64_t width, int64_t height);
 void dump_canvas(char *canvas, int width, int height);
 void dump_canvas_rgb(struct rgb *canvas, int width, int height);
 int write_img(struct rgb *image, char *file, int width, int height);
 struct rgb *make_canvas(int width, int height);
+struct rgb *make_canvas_mapped(char *file, int width, int height);
+int free_canvas_mapped(struct rgb *image, int width, int height);
 int cmp_canvas(char *exp, char *act, int width, int height, int verbose);
-void init_canvas(int start, int end, char *canvas, char value);
+int cmp_image(struct rgb *exp, struct rgb *act, int width, int height, int verbose);
+uint64_t canvas_hash(char *canvas, int width, int height);
+uint64_t image_hash(struct rgb *image, int width, int height);
+void init_canvas(uint64_t start, uint64_t end, char *canvas, char value);
+uint64_t canvas_area(int width, int height);
+uint64_t canvas_bytes(uint64_t area);
+const char *canvas_layout_name(enum canvas_layout layout);
+int canvas_mapped(uint64_t area);
+char *canvas_alloc(uint64_t area);
+void canvas_release(char *canvas);
+void canvas_reuse(int enable);
 void scale_dragon(int start, int end, struct rgb *image, int image_width, int image_height,
         char *dragon, int dragon_width, int dragon_height, struct palette *palette);
+void scale_dragon_window(int start, int end, struct rgb *image, int image_width, int image_height,
+        char *dragon, int canvas_width, int64_t i0, int64_t j0, int dragon_width, int dragon_height,
+        struct palette *palette);
 int dragon_draw_raw(uint64_t start, uint64_t end, char *dragon, int width, int height, limits_t limits, char id);
+int dragon_draw_raw_serial(uint64_t start, uint64_t end, char *dragon, int width, int height,
+		limits_t limits, char id);
+int dragon_draw_scaled(uint64_t start, uint64_t end, int64_t *sums, int image_width, int image_height,
+		int dragon_width, int dragon_height, limits_t limits, struct rgb color);
+void scale_sums(int start, int end, struct rgb *image, int image_width, int image_height,
+        int64_t *sums, int dragon_width, int dragon_height);
 
 #endif /* DRAGON_H_ */
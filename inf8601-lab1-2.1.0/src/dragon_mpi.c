@@ -0,0 +1,336 @@
+/*
+ * dragon_mpi.c
+ *
+ * Each rank of mpirun takes a contiguous range of segments. The pieces of
+ * the ranks are merged by a reduction in rank order, piece_merge not being
+ * commutative. Each rank then draws its range, either in a band holding
+ * the canvas rows of its segments or straight in the sums of the pixels
+ * like the stream lib, and the sums of all the ranks are added in the
+ * image of rank 0. A cell is crossed by a single segment, so adding the
+ * sums of the ranks gives the image of the serial lib.
+ */
+
+#include "config.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dragon.h"
+#include "dragon_mpi.h"
+#include "dragon_trace.h"
+#include "metrics.h"
+
+enum mpi_draw_mode {
+	MPI_DRAW_SCALED,
+	MPI_DRAW_BAND,
+};
+
+static enum mpi_draw_mode draw_mode = MPI_DRAW_SCALED;
+
+int dragon_mpi_draw_mode(const char *mode)
+{
+	if (strcmp(mode, "scaled") == 0)
+		draw_mode = MPI_DRAW_SCALED;
+	else if (strcmp(mode, "band") == 0)
+		draw_mode = MPI_DRAW_BAND;
+	else
+		return -1;
+	return 0;
+}
+
+#ifdef HAVE_MPI
+
+#include <mpi.h>
+
+static int rank = 0;
+static int nb_rank = 1;
+static MPI_Datatype piece_type = MPI_DATATYPE_NULL;
+static MPI_Op merge_op = MPI_OP_NULL;
+
+/* in holds the pieces of the lower ranks, merged in front of inout */
+static void piece_merge_op(void *in, void *inout, int *len,
+		__attribute__((unused)) MPI_Datatype *type)
+{
+	piece_t *first = (piece_t *) in;
+	piece_t *second = (piece_t *) inout;
+	int k;
+
+	for (k = 0; k < *len; k++) {
+		piece_t piece = first[k];
+		piece_merge(&piece, second[k]);
+		second[k] = piece;
+	}
+}
+
+static void dragon_mpi_finalize(void)
+{
+	int finalized;
+
+	MPI_Finalized(&finalized);
+	if (finalized)
+		return;
+	MPI_Op_free(&merge_op);
+	MPI_Type_free(&piece_type);
+	MPI_Finalize();
+}
+
+/* called before the first use, only the runs of the mpi lib need mpirun */
+int dragon_mpi_init(void)
+{
+	int initialized;
+
+	MPI_Initialized(&initialized);
+	if (initialized)
+		return 0;
+	if (MPI_Init(NULL, NULL) != MPI_SUCCESS) {
+		printf("MPI init error\n");
+		return -1;
+	}
+	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_size(MPI_COMM_WORLD, &nb_rank);
+	MPI_Type_contiguous(sizeof(piece_t) / sizeof(int64_t), MPI_INT64_T, &piece_type);
+	MPI_Type_commit(&piece_type);
+	MPI_Op_create(piece_merge_op, 0, &merge_op);
+	atexit(dragon_mpi_finalize);
+	return 0;
+}
+
+int dragon_mpi_root(void)
+{
+	return rank == 0;
+}
+
+/* the other ranks would wait forever in the reductions */
+static void mpi_abort(const char *msg)
+{
+	printf("%s on rank %d\n", msg, rank);
+	MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+}
+
+/* busy time of each rank, reported by rank 0 as the time of its threads */
+static void metrics_ranks(double busy)
+{
+	double *all = NULL;
+	int r;
+
+	if (rank == 0 && (all = (double *) calloc(nb_rank, sizeof(double))) == NULL)
+		mpi_abort("metrics gather error");
+	MPI_Gather(&busy, 1, MPI_DOUBLE, all, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+	for (r = 0; all != NULL && r < nb_rank; r++)
+		metrics_thread(r, all[r]);
+	FREE(all);
+}
+
+/*
+ * Limits of the dragon, and if band is not NULL those of the range of this
+ * rank: the pieces of the lower ranks give its start position.
+ */
+static double rank_limits(uint64_t size, limits_t *limits, limits_t *band)
+{
+	piece_t piece, prefix, dragon;
+	uint64_t start = range_part(size, rank, nb_rank);
+	uint64_t end = range_part(size, rank + 1, nb_rank);
+	double begin = metrics_now(), busy;
+
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, size);
+	TRACE_WORK_BEGIN(METRICS_LIMITS, start, end);
+	piece_init(&piece);
+	piece_limit(start, end, &piece);
+	TRACE_WORK_END(METRICS_LIMITS, start, end);
+	busy = metrics_now() - begin;
+
+	MPI_Allreduce(&piece, &dragon, 1, piece_type, merge_op, MPI_COMM_WORLD);
+	*limits = dragon.limits;
+	if (band != NULL) {
+		piece_init(&prefix);
+		MPI_Exscan(&piece, &prefix, 1, piece_type, merge_op, MPI_COMM_WORLD);
+		/* the result of rank 0 is undefined, its range starts at the origin */
+		if (rank == 0)
+			piece_init(&prefix);
+		prefix.limits.minimums = prefix.position;
+		prefix.limits.maximums = prefix.position;
+		piece_merge(&prefix, piece);
+		*band = prefix.limits;
+	}
+	TRACE_PHASE_END(METRICS_LIMITS);
+	metrics_phase(METRICS_LIMITS, metrics_now() - begin);
+	return busy;
+}
+
+int dragon_limits_mpi(limits_t *limits, uint64_t size, __attribute__((unused)) int nb_thread)
+{
+	if (dragon_mpi_init() < 0)
+		return -1;
+	metrics_ranks(rank_limits(size, limits, NULL));
+	return 0;
+}
+
+/* adds the cells of the band, offset rows below the top of the dragon, to the sums */
+static void band_sums(char *band, int64_t offset, int band_height, int64_t *sums,
+		int image_width, int image_height, int dragon_width, int dragon_height,
+		struct palette *palette)
+{
+	int64_t scale_x = dragon_width / image_width + 1;
+	int64_t scale_y = dragon_height / image_height + 1;
+	int64_t scale = (scale_x > scale_y ? scale_x : scale_y);
+	int64_t deltaJ = (scale * image_width - dragon_width) / 2;
+	int64_t deltaI = (scale * image_height - dragon_height) / 2;
+	int narrow = scale_narrow(scale, image_width, image_height);
+	enum canvas_layout layout = canvas_layout;
+	int packed = canvas_packed;
+	int64_t i, j;
+
+	for (i = 0; i < band_height; i++) {
+		int64_t *row = &sums[3 * (scale_cell(i + offset + deltaI, scale, narrow) * image_width)];
+		for (j = 0; j < dragon_width; j++) {
+			char id = canvas_get(packed, band, canvas_index(layout, i, j, dragon_width));
+			if (id < 0)
+				continue;
+			int64_t *sum = &row[3 * scale_cell(j + deltaJ, scale, narrow)];
+			sum[0] += (int64_t) palette->colors[(int) id].r - 255;
+			sum[1] += (int64_t) palette->colors[(int) id].g - 255;
+			sum[2] += (int64_t) palette->colors[(int) id].b - 255;
+		}
+	}
+}
+
+int dragon_draw_mpi(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_colors)
+{
+	int ret = 0;
+	int64_t *sums = NULL;
+	char *band = NULL;
+	struct palette *palette = NULL;
+	limits_t limits, band_limits;
+	double begin, work, ms;
+	int band_height = 0;
+	uint64_t area = 0;
+	int m;
+
+	if (dragon_mpi_init() < 0)
+		return -1;
+	uint64_t start = range_part(size, rank, nb_rank);
+	uint64_t end = range_part(size, rank + 1, nb_rank);
+
+	/* 1. Calculer les limites du dragon et de la bande du rang */
+	work = rank_limits(size, &limits, draw_mode == MPI_DRAW_BAND ? &band_limits : NULL);
+
+	int dragon_width = limits.maximums.x - limits.minimums.x;
+	int dragon_height = limits.maximums.y - limits.minimums.y;
+
+	/* 2. Allouer les sommes des pixels, et la bande en mode band */
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+	sums = (int64_t *) calloc(3 * width * height, sizeof(int64_t));
+	if (sums == NULL)
+		goto err;
+	if (draw_mode == MPI_DRAW_BAND) {
+		band_height = band_limits.maximums.y - band_limits.minimums.y;
+		band_limits.minimums.x = limits.minimums.x;
+		area = canvas_area(dragon_width, band_height);
+	}
+	/* a rank without segments has an empty band */
+	if (area > 0) {
+		if ((band = canvas_alloc(area)) == NULL)
+			goto err;
+		TRACE_WORK_BEGIN(METRICS_CLEAR, 0, area);
+		init_canvas(0, area, band, -1);
+		TRACE_WORK_END(METRICS_CLEAR, 0, area);
+	}
+	TRACE_PHASE_END(METRICS_CLEAR);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_CLEAR, ms);
+	work += ms;
+
+	palette = init_palette(nb_colors);
+	if (palette == NULL)
+		goto err;
+
+	/* 3. Dessiner l'intervalle du rang, avec les couleurs du découpage de la lib serial */
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+	for (m = 0; m < nb_colors; m++) {
+		uint64_t first = range_part(size, m, nb_colors);
+		uint64_t last = range_part(size, m + 1, nb_colors);
+		if (first < start)
+			first = start;
+		if (last > end)
+			last = end;
+		if (first >= last)
+			continue;
+		TRACE_WORK_BEGIN(METRICS_DRAW, first, last);
+		if (draw_mode == MPI_DRAW_BAND)
+			ret = dragon_draw_raw_serial(first, last, band, dragon_width, band_height,
+					band_limits, m);
+		else
+			ret = dragon_draw_scaled(first, last, sums, width, height, dragon_width,
+					dragon_height, limits, palette->colors[m]);
+		TRACE_WORK_END(METRICS_DRAW, first, last);
+		if (ret < 0)
+			goto err;
+	}
+	TRACE_PHASE_END(METRICS_DRAW);
+	ms = metrics_now() - begin;
+	metrics_phase(METRICS_DRAW, ms);
+	work += ms;
+	printf("Draw calcul time (mpi %s, %d ranks): %d milliseconds\n",
+			draw_mode == MPI_DRAW_BAND ? "band" : "scaled", nb_rank, (int) ms);
+
+	/* 4. Additionner les sommes des rangs dans l'image du rang 0 */
+	begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+	TRACE_WORK_BEGIN(METRICS_RENDER, 0, height);
+	if (draw_mode == MPI_DRAW_BAND)
+		band_sums(band, band_limits.minimums.y - limits.minimums.y, band_height, sums,
+				width, height, dragon_width, dragon_height, palette);
+	work += metrics_now() - begin;
+	MPI_Reduce(rank == 0 ? MPI_IN_PLACE : sums, sums, 3 * width * height, MPI_INT64_T,
+			MPI_SUM, 0, MPI_COMM_WORLD);
+	if (rank == 0)
+		scale_sums(0, height, image, width, height, sums, dragon_width, dragon_height);
+	TRACE_WORK_END(METRICS_RENDER, 0, height);
+	TRACE_PHASE_END(METRICS_RENDER);
+	metrics_phase(METRICS_RENDER, metrics_now() - begin);
+	metrics_ranks(work);
+
+done:
+	free_palette(palette);
+	canvas_release(band);
+	FREE(sums);
+	*canvas = NULL;
+	return ret;
+
+err:
+	mpi_abort("mpi draw error");
+	ret = -1;
+	goto done;
+}
+
+#else /* HAVE_MPI */
+
+int dragon_draw_mpi(char **canvas, __attribute__((unused)) struct rgb *image,
+		__attribute__((unused)) int width, __attribute__((unused)) int height,
+		__attribute__((unused)) uint64_t size, __attribute__((unused)) int nb_thread)
+{
+	printf("MPI is not available\n");
+	*canvas = NULL;
+	return -1;
+}
+
+int dragon_limits_mpi(__attribute__((unused)) limits_t *limits,
+		__attribute__((unused)) uint64_t size, __attribute__((unused)) int nb_thread)
+{
+	printf("MPI is not available\n");
+	return -1;
+}
+
+int dragon_mpi_init(void)
+{
+	return 0;
+}
+
+int dragon_mpi_root(void)
+{
+	return 1;
+}
+
+#endif /* HAVE_MPI */
@@ -0,0 +1,18 @@
+/*
+ * dragon_mpi.h
+ *
+ *  MPI implementation of dragonizer, one range of segments per rank
+ */
+
+#ifndef DRAGON_MPI_H_
+#define DRAGON_MPI_H_
+
+#include "dragon.h"
+
+int dragon_draw_mpi(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_mpi(limits_t *limits, uint64_t size, int nb_thread);
+int dragon_mpi_draw_mode(const char *mode);
+int dragon_mpi_init(void);
+int dragon_mpi_root(void);
+
+#endif /* DRAGON_MPI_H_ */
@@ -0,0 +1,274 @@
+/*
+ * dragon_openmp.c
+ *
+ * Loops are scheduled with schedule(runtime), set from the command line
+ * with dragon_openmp_schedule().
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <omp.h>
+
+#include "dragon.h"
+#include "color.h"
+#include "dragon_openmp.h"
+#include "metrics.h"
+#include "dragon_trace.h"
+
+/* number of blocks of segments for the limits */
+#define LIMIT_BLOCKS	256
+/* number of blocks of segments per color for the draw */
+#define DRAW_BLOCKS		16
+/* cells cleared per iteration */
+#define CLEAR_BLOCK		4096
+
+/*
+ * Pieces of contiguous runs of blocks, sorted by block. Adjacent runs are
+ * merged as soon as both are known, in the order of the blocks, so the
+ * reduction gives the same piece whatever the order OpenMP combines the
+ * private copies. There is at most one run per block.
+ */
+struct piece_runs {
+	int len;
+	struct {
+		int first;
+		int last;
+		piece_t piece;
+	} run[LIMIT_BLOCKS];
+};
+
+static void runs_init(struct piece_runs *runs)
+{
+	runs->len = 0;
+}
+
+/* add the piece of blocks [first, last) */
+static void runs_add(struct piece_runs *runs, int first, int last, piece_t piece)
+{
+	int k = 0;
+
+	while (k < runs->len && runs->run[k].first < first)
+		k++;
+
+	if (k > 0 && runs->run[k - 1].last == first) {
+		piece_merge(&runs->run[k - 1].piece, piece);
+		runs->run[k - 1].last = last;
+		if (k < runs->len && runs->run[k].first == last) {
+			piece_merge(&runs->run[k - 1].piece, runs->run[k].piece);
+			runs->run[k - 1].last = runs->run[k].last;
+			memmove(&runs->run[k], &runs->run[k + 1], sizeof(runs->run[0]) * (runs->len - k - 1));
+			runs->len--;
+		}
+	} else if (k < runs->len && runs->run[k].first == last) {
+		piece_merge(&piece, runs->run[k].piece);
+		runs->run[k].first = first;
+		runs->run[k].piece = piece;
+	} else {
+		memmove(&runs->run[k + 1], &runs->run[k], sizeof(runs->run[0]) * (runs->len - k));
+		runs->run[k].first = first;
+		runs->run[k].last = last;
+		runs->run[k].piece = piece;
+		runs->len++;
+	}
+}
+
+static void runs_combine(struct piece_runs *out, struct piece_runs *in)
+{
+	int k;
+	for (k = 0; k < in->len; k++)
+		runs_add(out, in->run[k].first, in->run[k].last, in->run[k].piece);
+}
+
+#pragma omp declare reduction(piece_order : struct piece_runs : runs_combine(&omp_out, &omp_in)) \
+	initializer(runs_init(&omp_priv))
+
+/*
+ * Parse schedule[,chunk] where schedule is static, dynamic or guided.
+ */
+int dragon_openmp_schedule(const char *schedule)
+{
+	omp_sched_t kind;
+	int chunk = 0;
+	const char *comma = strchr(schedule, ',');
+	size_t len = comma ? (size_t) (comma - schedule) : strlen(schedule);
+
+	if (len == strlen("static") && strncmp(schedule, "static", len) == 0)
+		kind = omp_sched_static;
+	else if (len == strlen("dynamic") && strncmp(schedule, "dynamic", len) == 0)
+		kind = omp_sched_dynamic;
+	else if (len == strlen("guided") && strncmp(schedule, "guided", len) == 0)
+		kind = omp_sched_guided;
+	else
+		return -1;
+
+	if (comma != NULL) {
+		chunk = atoi(comma + 1);
+		if (chunk <= 0)
+			return -1;
+	}
+	omp_set_schedule(kind, chunk);
+	return 0;
+}
+
+int dragon_draw_openmp(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	struct palette *palette = NULL;
+	char *dragon = NULL;
+	limits_t limits;
+	uint64_t area;
+	int64_t i;
+	double start;
+
+	palette = init_palette(nb_thread);
+	if (palette == NULL)
+		goto err;
+
+	/* 1. Calculer les limites du dragon */
+	if (dragon_limits_openmp(&limits, size, nb_thread) < 0)
+		goto err;
+
+	int dragon_width = limits.maximums.x - limits.minimums.x;
+	int dragon_height = limits.maximums.y - limits.minimums.y;
+	area = canvas_area(dragon_width, dragon_height);
+	int64_t clear_blocks = (area + CLEAR_BLOCK - 1) / CLEAR_BLOCK;
+	int64_t draw_blocks = (int64_t) nb_thread * DRAW_BLOCKS;
+
+	if ((dragon = canvas_alloc(area)) == NULL) {
+		printf("malloc error dragon\n");
+		goto err;
+	}
+
+	#pragma omp parallel num_threads(nb_thread)
+	{
+		/* loops are nowait so that each thread times its own share */
+		double busy, begin;
+
+		/* 2. Initialiser la surface */
+		#pragma omp master
+		{
+			start = omp_get_wtime();
+			TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+		}
+		/* master has no barrier, the phase starts once start is set */
+		#pragma omp barrier
+		begin = omp_get_wtime();
+		#pragma omp for schedule(runtime) nowait
+		for (i = 0; i < clear_blocks; i++) {
+			uint64_t end = (i + 1) * CLEAR_BLOCK;
+			if (end > area)
+				end = area;
+			TRACE_WORK_BEGIN(METRICS_CLEAR, i * CLEAR_BLOCK, end);
+			init_canvas(i * CLEAR_BLOCK, end, dragon, -1);
+			TRACE_WORK_END(METRICS_CLEAR, i * CLEAR_BLOCK, end);
+		}
+		busy = omp_get_wtime() - begin;
+		#pragma omp barrier
+		#pragma omp master
+		{
+			TRACE_PHASE_END(METRICS_CLEAR);
+			metrics_phase(METRICS_CLEAR, (omp_get_wtime() - start) * 1000);
+			printf("Clear calcul time: %d milliseconds\n", (int) ((omp_get_wtime() - start) * 1000));
+			start = omp_get_wtime();
+			TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+		}
+		#pragma omp barrier
+
+		/* 3. Dessiner le dragon, chaque couleur en DRAW_BLOCKS blocs */
+		begin = omp_get_wtime();
+		#pragma omp for schedule(runtime) nowait
+		for (i = 0; i < draw_blocks; i++) {
+			int id = i / DRAW_BLOCKS;
+			int k = i % DRAW_BLOCKS;
+			uint64_t first = range_part(size, id, nb_thread);
+			uint64_t last = range_part(size, id + 1, nb_thread);
+			uint64_t begin = first + k * (last - first) / DRAW_BLOCKS;
+			uint64_t end = first + (k + 1) * (last - first) / DRAW_BLOCKS;
+			TRACE_WORK_BEGIN(METRICS_DRAW, begin, end);
+			dragon_draw_raw(begin, end, dragon, dragon_width, dragon_height, limits, id);
+			TRACE_WORK_END(METRICS_DRAW, begin, end);
+		}
+		busy += omp_get_wtime() - begin;
+		#pragma omp barrier
+		#pragma omp master
+		{
+			TRACE_PHASE_END(METRICS_DRAW);
+			metrics_phase(METRICS_DRAW, (omp_get_wtime() - start) * 1000);
+			printf("Draw calcul time (%s): %d milliseconds\n", canvas_layout_name(canvas_layout),
+					(int) ((omp_get_wtime() - start) * 1000));
+			start = omp_get_wtime();
+			TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+		}
+		#pragma omp barrier
+
+		/* 4. Effectuer le rendu final */
+		begin = omp_get_wtime();
+		#pragma omp for schedule(runtime) nowait
+		for (i = 0; i < height; i++) {
+			TRACE_WORK_BEGIN(METRICS_RENDER, i, i + 1);
+			scale_dragon(i, i + 1, image, width, height, dragon, dragon_width, dragon_height, palette);
+			TRACE_WORK_END(METRICS_RENDER, i, i + 1);
+		}
+		busy += omp_get_wtime() - begin;
+		metrics_thread(omp_get_thread_num(), busy * 1000);
+		#pragma omp barrier
+		#pragma omp master
+		{
+			TRACE_PHASE_END(METRICS_RENDER);
+			metrics_phase(METRICS_RENDER, (omp_get_wtime() - start) * 1000);
+			printf("Render calcul time: %d milliseconds\n", (int) ((omp_get_wtime() - start) * 1000));
+		}
+	}
+
+	free_palette(palette);
+	*canvas = dragon;
+	return 0;
+
+err:
+	free_palette(palette);
+	canvas_release(dragon);
+	*canvas = NULL;
+	return -1;
+}
+
+/*
+ * Calcule les limites en terme de largeur et de hauteur de
+ * la forme du dragon. Requis pour allouer la matrice de dessin.
+ */
+int dragon_limits_openmp(limits_t *limits, uint64_t size, int nb_thread)
+{
+	struct piece_runs runs;
+	int blocks = size < LIMIT_BLOCKS ? (int) size : LIMIT_BLOCKS;
+	double start = omp_get_wtime();
+	int i;
+
+	runs_init(&runs);
+	if (blocks == 0) {
+		piece_t piece;
+		piece_init(&piece);
+		*limits = piece.limits;
+		return 0;
+	}
+
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, size);
+	#pragma omp parallel for num_threads(nb_thread) schedule(runtime) reduction(piece_order:runs)
+	for (i = 0; i < blocks; i++) {
+		piece_t piece;
+		uint64_t start = range_part(size, i, blocks);
+		uint64_t end = range_part(size, i + 1, blocks);
+		piece_init(&piece);
+		TRACE_WORK_BEGIN(METRICS_LIMITS, start, end);
+		piece_limit(start, end, &piece);
+		TRACE_WORK_END(METRICS_LIMITS, start, end);
+		runs_add(&runs, i, i + 1, piece);
+	}
+	TRACE_PHASE_END(METRICS_LIMITS);
+
+	if (runs.len != 1)
+		return -1;
+	*limits = runs.run[0].piece.limits;
+	metrics_phase(METRICS_LIMITS, (omp_get_wtime() - start) * 1000);
+	printf("Limit calcul time: %d milliseconds\n", (int) ((omp_get_wtime() - start) * 1000));
+	return 0;
+}
@@ -0,0 +1,16 @@
+/*
+ * dragon_openmp.h
+ *
+ *  OpenMP implementation of dragonizer
+ */
+
+#ifndef DRAGON_OPENMP_H_
+#define DRAGON_OPENMP_H_
+
+#include "dragon.h"
+
+int dragon_draw_openmp(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_openmp(limits_t *lim, uint64_t size, int nb_thread);
+int dragon_openmp_schedule(const char *schedule);
+
+#endif /* DRAGON_OPENMP_H_ */
@@ -15,7 +15,10 @@
 #include "dragon.h"
 #include "color.h"
 #include "dragon_pthread.h"
+#include "pool.h"
 #include "utils.h"
+#include "metrics.h"
+#include "dragon_trace.h"
 
 pthread_mutex_t mutex_stdout;
 
@@ -29,49 +32,170 @@ void printf_safe(char *format, ...) {
 	va_end(ap);
 }
 
-void *dragon_draw_worker(void *data) {
-	struct draw_data* info = (struct draw_data*) data;
-	
-	/* 1. Initialiser la surface */
-	uint64_t surface = info->dragon_width * info->dragon_height;
-	uint64_t start = info->id*surface/info->nb_thread;
-	uint64_t end = (info->id + 1)*surface/info->nb_thread;
-	init_canvas(start,end,info->dragon, -1); 
-	pthread_barrier_wait(info->barrier);
-
-	/* 2. Dessiner le dragon */
-	start = info->id * info->size / info->nb_thread;
-	end = (info->id + 1) * info->size / info->nb_thread;
-	dragon_draw_raw(start,end,info->dragon, info->dragon_width, info->dragon_height, info->limits, info->id);
-	pthread_barrier_wait(info->barrier);
-	
-	/* 3. Effectuer le rendu final */
-	start = info->id * info->image_height / info->nb_thread;
-	end = (info->id + 1) * info->image_height / info->nb_thread;
-	scale_dragon(start,end, info->image, info->image_width, info->image_height, info->dragon, info->dragon_width, info->dragon_height, info->palette);
-
-	return NULL;
+enum pthread_schedule {
+	PTHREAD_SCHEDULE_STATIC,
+	PTHREAD_SCHEDULE_DYNAMIC,
+};
+
+enum draw_phase {
+	PHASE_CLEAR,
+	PHASE_DRAW,
+	PHASE_RENDER,
+	PHASE_COUNT,
+};
+
+static enum pthread_schedule schedule = PTHREAD_SCHEDULE_STATIC;
+static int schedule_chunks = 16;
+
+/*
+ * State shared by the workers of dragon_draw_pthread. In the dynamic
+ * schedule, each phase is split in nb_thread * schedule_chunks chunks handed
+ * out by an atomic counter; in the static schedule, thread id gets chunk id.
+ */
+struct pthread_draw {
+	struct draw_data info;
+	uint64_t chunks;
+	uint64_t next;
+	double *busy[PHASE_COUNT];
+	/* the draw phase draws the segments from..info.size */
+	uint64_t from;
+	/* the render phase renders this window of the canvas */
+	int64_t i0;
+	int64_t j0;
+	int window_width;
+	int window_height;
+};
+
+/*
+ * Parse static or dynamic[,chunks], chunks being the number of chunks per
+ * thread of each phase.
+ */
+int dragon_pthread_schedule(const char *arg)
+{
+	if (strcmp(arg, "static") == 0) {
+		schedule = PTHREAD_SCHEDULE_STATIC;
+	} else if (strncmp(arg, "dynamic", strlen("dynamic")) == 0) {
+		const char *chunks = arg + strlen("dynamic");
+		if (*chunks == ',') {
+			schedule_chunks = atoi(chunks + 1);
+			if (schedule_chunks <= 0)
+				return -1;
+		} else if (*chunks != '\0') {
+			return -1;
+		}
+		schedule = PTHREAD_SCHEDULE_DYNAMIC;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t first_chunk(struct pthread_draw *draw, int id)
+{
+	if (schedule == PTHREAD_SCHEDULE_STATIC)
+		return id;
+	return __atomic_fetch_add(&draw->next, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t next_chunk(struct pthread_draw *draw)
+{
+	if (schedule == PTHREAD_SCHEDULE_STATIC)
+		return draw->chunks;
+	return __atomic_fetch_add(&draw->next, 1, __ATOMIC_RELAXED);
+}
+
+void dragon_clear_worker(int id, void *data) {
+	struct pthread_draw *draw = (struct pthread_draw *) data;
+	struct draw_data* info = &draw->info;
+	uint64_t surface = canvas_area(info->dragon_width, info->dragon_height);
+	double begin = metrics_now();
+	uint64_t c;
+	for (c = first_chunk(draw, id); c < draw->chunks; c = next_chunk(draw)) {
+		uint64_t start = range_part(surface, c, draw->chunks);
+		uint64_t end = range_part(surface, c + 1, draw->chunks);
+		TRACE_WORK_BEGIN(METRICS_CLEAR, start, end);
+		init_canvas(start,end,info->dragon, -1);
+		TRACE_WORK_END(METRICS_CLEAR, start, end);
+	}
+	draw->busy[PHASE_CLEAR][id] = metrics_now() - begin;
+}
+
+void dragon_draw_worker(int id, void *data) {
+	struct pthread_draw *draw = (struct pthread_draw *) data;
+	struct draw_data* info = &draw->info;
+	uint64_t per_color = draw->chunks / info->nb_thread;
+	uint64_t count = info->size - draw->from;
+	double begin = metrics_now();
+	uint64_t c;
+	/* chunks never span two colors, each color being per_color chunks */
+	for (c = first_chunk(draw, id); c < draw->chunks; c = next_chunk(draw)) {
+		int color = c / per_color;
+		uint64_t k = c % per_color;
+		uint64_t first = draw->from + range_part(count, color, info->nb_thread);
+		uint64_t last = draw->from + range_part(count, color + 1, info->nb_thread);
+		uint64_t start = first + k * (last - first) / per_color;
+		uint64_t end = first + (k + 1) * (last - first) / per_color;
+		TRACE_WORK_BEGIN(METRICS_DRAW, start, end);
+		dragon_draw_raw(start,end,info->dragon, info->dragon_width, info->dragon_height, info->limits, color);
+		TRACE_WORK_END(METRICS_DRAW, start, end);
+	}
+	draw->busy[PHASE_DRAW][id] = metrics_now() - begin;
+}
+
+void dragon_render_worker(int id, void *data) {
+	struct pthread_draw *draw = (struct pthread_draw *) data;
+	struct draw_data* info = &draw->info;
+	double begin = metrics_now();
+	uint64_t c;
+	for (c = first_chunk(draw, id); c < draw->chunks; c = next_chunk(draw)) {
+		uint64_t start = c * info->image_height / draw->chunks;
+		uint64_t end = (c + 1) * info->image_height / draw->chunks;
+		TRACE_WORK_BEGIN(METRICS_RENDER, start, end);
+		scale_dragon_window(start, end, info->image, info->image_width, info->image_height,
+				info->dragon, info->dragon_width, draw->i0, draw->j0,
+				draw->window_width, draw->window_height, info->palette);
+		TRACE_WORK_END(METRICS_RENDER, start, end);
+	}
+	draw->busy[PHASE_RENDER][id] = metrics_now() - begin;
+}
+
+static double run_phase(struct pool *pool, pool_task task, struct pthread_draw *draw,
+		enum metrics_phase phase)
+{
+	double begin = metrics_now();
+	draw->next = 0;
+	TRACE_PHASE_BEGIN(phase, draw->info.size);
+	pool_run(pool, task, draw);
+	TRACE_PHASE_END(phase);
+	return metrics_now() - begin;
 }
 
 int dragon_draw_pthread(char **canvas, struct rgb *image, int width, int height,
 		uint64_t size, int nb_thread) {
-	pthread_t *threads = NULL;
-	pthread_barrier_t barrier;
+	struct pool *pool = NULL;
 	limits_t limits;
-	struct draw_data info;
+	struct pthread_draw draw;
+	struct draw_data *info = &draw.info;
+	double *busy = NULL;
+	double wall[PHASE_COUNT];
 	char *dragon = NULL;
-	int scale_x;
-	int scale_y;
-	struct draw_data *data = NULL;
+	int64_t scale_x;
+	int64_t scale_y;
 	struct palette *palette = NULL;
 	int ret = 0;
+	int i, p;
 
 	palette = init_palette(nb_thread);
 	if (palette == NULL)
 		goto err;
 
-	if (pthread_barrier_init(&barrier, NULL, nb_thread) != 0) {
-		printf("barrier init error\n");
+	if ((pool = pool_get(nb_thread)) == NULL) {
+		printf("pool init error\n");
+		goto err;
+	}
+
+	if ((busy = calloc(PHASE_COUNT * nb_thread, sizeof(double))) == NULL) {
+		printf("malloc error busy\n");
 		goto err;
 	}
 
@@ -79,76 +203,194 @@ int dragon_draw_pthread(char **canvas, struct rgb *image, int width, int height,
 	if (dragon_limits_pthread(&limits, size, nb_thread) < 0)
 		goto err;
 
-	info.dragon_width = limits.maximums.x - limits.minimums.x;
-	info.dragon_height = limits.maximums.y - limits.minimums.y;
+	info->dragon_width = limits.maximums.x - limits.minimums.x;
+	info->dragon_height = limits.maximums.y - limits.minimums.y;
 
-	if ((dragon = (char *) malloc(info.dragon_width * info.dragon_height))
+	if ((dragon = canvas_alloc(canvas_area(info->dragon_width, info->dragon_height)))
 			== NULL) {
 		printf("malloc error dragon\n");
 		goto err;
 	}
 
-	if ((data = malloc(sizeof(struct draw_data) * nb_thread)) == NULL) {
-		printf("malloc error data\n");
-		goto err;
+	info->image_height = height;
+	info->image_width = width;
+	scale_x = info->dragon_width / width + 1;
+	scale_y = info->dragon_height / height + 1;
+	info->scale = (scale_x > scale_y ? scale_x : scale_y);
+	info->deltaJ = (info->scale * width - info->dragon_width) / 2;
+	info->deltaI = (info->scale * height - info->dragon_height) / 2;
+	info->nb_thread = nb_thread;
+	info->dragon = dragon;
+	info->image = image;
+	info->size = size;
+	info->limits = limits;
+	info->palette = palette;
+	draw.chunks = nb_thread;
+	if (schedule == PTHREAD_SCHEDULE_DYNAMIC)
+		draw.chunks *= schedule_chunks;
+	for (p = 0; p < PHASE_COUNT; p++)
+		draw.busy[p] = &busy[p * nb_thread];
+	draw.from = 0;
+	draw.i0 = 0;
+	draw.j0 = 0;
+	draw.window_width = info->dragon_width;
+	draw.window_height = info->dragon_height;
+
+	/* 2. Calcul parallèle principal, chaque étape attend la précédente */
+	wall[PHASE_CLEAR] = run_phase(pool, dragon_clear_worker, &draw, METRICS_CLEAR);
+	wall[PHASE_DRAW] = run_phase(pool, dragon_draw_worker, &draw, METRICS_DRAW);
+	wall[PHASE_RENDER] = run_phase(pool, dragon_render_worker, &draw, METRICS_RENDER);
+	metrics_phase(METRICS_CLEAR, wall[PHASE_CLEAR]);
+	metrics_phase(METRICS_DRAW, wall[PHASE_DRAW]);
+	metrics_phase(METRICS_RENDER, wall[PHASE_RENDER]);
+
+	printf("Draw calcul time (%s): %d milliseconds\n", canvas_layout_name(canvas_layout),
+			(int) wall[PHASE_DRAW]);
+
+	/* idle: time spent waiting for the other threads at the end of a phase */
+	for (i = 0; i < nb_thread; i++) {
+		double idle = 0;
+		for (p = 0; p < PHASE_COUNT; p++)
+			idle += wall[p] - draw.busy[p][i];
+		printf("Thread %2d busy clear %8.2f draw %8.2f render %8.2f idle %8.2f milliseconds\n",
+				i, draw.busy[PHASE_CLEAR][i], draw.busy[PHASE_DRAW][i],
+				draw.busy[PHASE_RENDER][i], idle);
+		metrics_thread(i, draw.busy[PHASE_CLEAR][i] + draw.busy[PHASE_DRAW][i] +
+				draw.busy[PHASE_RENDER][i]);
 	}
+	done: free_palette(palette);
+	FREE(busy);
+	*canvas = dragon;
+	return ret;
+
+	err: canvas_release(dragon);
+	dragon = NULL;
+	ret = -1;
+	goto done;
+}
 
-	if ((threads = malloc(sizeof(pthread_t) * nb_thread)) == NULL) {
-		printf("malloc error threads\n");
+/*
+ * Draw the dragons of powers power to power_max in a single canvas. The first
+ * 2^k segments of a dragon are the dragon of power k, so each power draws only
+ * its new segments. The limits grow by merging the piece of the new segments,
+ * the canvas is allocated once for power_max, and each power is rendered
+ * from its own window of the canvas. frame is called after each power, the
+ * image being rendered when render is set and for power_max.
+ */
+int dragon_sweep_pthread(struct rgb *image, int width, int height, int power, int power_max,
+		int nb_thread, int render, dragon_frame frame, void *arg) {
+	struct pool *pool = NULL;
+	struct pthread_draw draw;
+	struct draw_data *info = &draw.info;
+	limits_t *limits = NULL;
+	piece_t piece, grow;
+	double *busy = NULL;
+	char *dragon = NULL;
+	struct palette *palette = NULL;
+	double ms;
+	int ret = 0;
+	int i, k, p;
+
+	palette = init_palette(nb_thread);
+	if (palette == NULL)
+		goto err;
+
+	if ((pool = pool_get(nb_thread)) == NULL) {
+		printf("pool init error\n");
 		goto err;
 	}
 
-	info.image_height = height;
-	info.image_width = width;
-	scale_x = info.dragon_width / width + 1;
-	scale_y = info.dragon_height / height + 1;
-	info.scale = (scale_x > scale_y ? scale_x : scale_y);
-	info.deltaJ = (info.scale * width - info.dragon_width) / 2;
-	info.deltaI = (info.scale * height - info.dragon_height) / 2;
-	info.nb_thread = nb_thread;
-	info.dragon = dragon;
-	info.image = image;
-	info.size = size;
-	info.limits = limits;
-	info.barrier = &barrier;
-	info.palette = palette;
-	
-	/* 2. Lancement du calcul parallèle principal avec draw_dragon_worker */
-	clock_t start = clock(), diff;
-	int i = 0;
-	for (i = 0; i < nb_thread; ++i) {
-		data[i] = info;
-		data[i].id = i;
-		pthread_create(&threads[i], NULL, dragon_draw_worker, &data[i]);
+	if ((busy = calloc(PHASE_COUNT * nb_thread, sizeof(double))) == NULL ||
+			(limits = calloc(power_max + 1, sizeof(limits_t))) == NULL) {
+		printf("malloc error sweep\n");
+		goto err;
 	}
-	/* 3. Attendre la fin du traitement */
-	for (i = 0; i < nb_thread; ++i) {
-		pthread_join(threads[i], NULL);
+
+	/* 1. Limites de chaque puissance, par fusion des nouveaux segments */
+	double begin = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, 1ULL << power_max);
+	piece_init(&piece);
+	piece_range(0, 1ULL << power, &piece);
+	limits[power] = piece.limits;
+	for (k = power + 1; k <= power_max; k++) {
+		piece_init(&grow);
+		piece_range(1ULL << (k - 1), 1ULL << k, &grow);
+		piece_merge(&piece, grow);
+		limits[k] = piece.limits;
 	}
-	
-	if (pthread_barrier_destroy(&barrier) != 0) {
-		printf("barrier destroy error\n");
+	TRACE_PHASE_END(METRICS_LIMITS);
+	metrics_phase(METRICS_LIMITS, metrics_now() - begin);
+
+	info->dragon_width = limits[power_max].maximums.x - limits[power_max].minimums.x;
+	info->dragon_height = limits[power_max].maximums.y - limits[power_max].minimums.y;
+	if ((dragon = canvas_alloc(canvas_area(info->dragon_width, info->dragon_height)))
+			== NULL) {
+		printf("malloc error dragon\n");
 		goto err;
 	}
-	diff = clock() - start;
-	int msec = diff * 1000 / CLOCKS_PER_SEC;
-	printf("Draw calcul time: %d milliseconds\n",msec);
-	done: FREE(data);
-	FREE(threads);
-	free_palette(palette);
-	*canvas = dragon;
+
+	info->image_height = height;
+	info->image_width = width;
+	info->nb_thread = nb_thread;
+	info->dragon = dragon;
+	info->image = image;
+	info->size = 1ULL << power_max;
+	info->limits = limits[power_max];
+	info->palette = palette;
+	draw.chunks = nb_thread;
+	if (schedule == PTHREAD_SCHEDULE_DYNAMIC)
+		draw.chunks *= schedule_chunks;
+	for (p = 0; p < PHASE_COUNT; p++)
+		draw.busy[p] = &busy[p * nb_thread];
+
+	/* 2. Le canevas est effacé une seule fois */
+	metrics_phase(METRICS_CLEAR, run_phase(pool, dragon_clear_worker, &draw, METRICS_CLEAR));
+
+	/* 3. Chaque puissance ajoute ses segments, puis est rendue de sa fenêtre */
+	for (k = power; k <= power_max; k++) {
+		draw.from = k == power ? 0 : 1ULL << (k - 1);
+		info->size = 1ULL << k;
+		ms = run_phase(pool, dragon_draw_worker, &draw, METRICS_DRAW);
+		metrics_phase(METRICS_DRAW, ms);
+		printf("Draw calcul time (%s, %"PRIu64" new segments): %d milliseconds\n",
+				canvas_layout_name(canvas_layout), info->size - draw.from, (int) ms);
+
+		if (render || k == power_max) {
+			draw.i0 = limits[k].minimums.y - limits[power_max].minimums.y;
+			draw.j0 = limits[k].minimums.x - limits[power_max].minimums.x;
+			draw.window_width = limits[k].maximums.x - limits[k].minimums.x;
+			draw.window_height = limits[k].maximums.y - limits[k].minimums.y;
+			metrics_phase(METRICS_RENDER,
+					run_phase(pool, dragon_render_worker, &draw, METRICS_RENDER));
+		}
+		for (i = 0; i < nb_thread; i++) {
+			metrics_thread(i, draw.busy[PHASE_CLEAR][i] + draw.busy[PHASE_DRAW][i] +
+					draw.busy[PHASE_RENDER][i]);
+			draw.busy[PHASE_CLEAR][i] = 0;
+			draw.busy[PHASE_RENDER][i] = 0;
+		}
+		if (frame(k, &info->image, arg) < 0)
+			goto err;
+	}
+
+	done: free_palette(palette);
+	FREE(busy);
+	FREE(limits);
+	canvas_release(dragon);
 	return ret;
 
-	err: FREE(dragon);
-	ret = -1;
+	err: ret = -1;
 	goto done;
 }
 
-void *dragon_limit_worker(void *data) {
-	struct limit_data *lim = (struct limit_data *) data;
+void dragon_limit_worker(int id, void *data) {
+	struct limit_data *lim = &((struct limit_data *) data)[id];
+	double begin = metrics_now();
+	TRACE_WORK_BEGIN(METRICS_LIMITS, lim->start, lim->end);
 	piece_limit(lim->start, lim->end, &lim->piece);
+	TRACE_WORK_END(METRICS_LIMITS, lim->start, lim->end);
+	lim->busy = metrics_now() - begin;
 	printf_safe("Pthread id: %d \n", gettid());
-	return NULL;
 }
 
 /*
@@ -157,42 +399,41 @@ void *dragon_limit_worker(void *data) {
  */
 int dragon_limits_pthread(limits_t *limits, uint64_t size, int nb_thread) {
 	int ret = 0;
-	pthread_t *threads = NULL;
+	struct pool *pool = NULL;
 	struct limit_data *thread_data = NULL;
 	piece_t master;
 
 	piece_init(&master);
 
-	if ((threads = calloc(nb_thread, sizeof(pthread_t))) == NULL)
+	if ((pool = pool_get(nb_thread)) == NULL)
 		goto err;
 
 	if ((thread_data = calloc(nb_thread, sizeof(struct limit_data))) == NULL)
 		goto err;
 
 	/* 1. Lancement du calcul en parallèle avec dragon_limit_worker */
-	clock_t start = clock(), diff;
+	double start = metrics_now(), ms;
 	int i = 0;
 	for (i = 0; i < nb_thread; ++i) {
 		thread_data[i].id = i;
-		thread_data[i].start = i * size/nb_thread;
-		thread_data[i].end = (i + 1) * size/nb_thread;
+		thread_data[i].start = range_part(size, i, nb_thread);
+		thread_data[i].end = range_part(size, i + 1, nb_thread);
 		thread_data[i].piece = master;
-		pthread_create(&threads[i], NULL, dragon_limit_worker, &thread_data[i]);
 	}
 	/* 2. Attendre la fin du traitement */
-	for (i = 0; i < nb_thread; ++i) {
-		pthread_join(threads[i], NULL);
-	}
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, size);
+	pool_run(pool, dragon_limit_worker, thread_data);
+	TRACE_PHASE_END(METRICS_LIMITS);
 	/* 3. Fusion des pièces */
 	for( i = 0; i < nb_thread; ++i)
 	{
 		piece_merge(&master, thread_data[i].piece);
+		metrics_thread(i, thread_data[i].busy);
 	}
-	diff = clock() - start;
-	int msec = diff * 1000/CLOCKS_PER_SEC;
-	printf("Limit calcul time: %d milliseconds\n",msec);
-	done: FREE(threads);
-	FREE(thread_data);
+	ms = metrics_now() - start;
+	metrics_phase(METRICS_LIMITS, ms);
+	printf("Limit calcul time: %d milliseconds\n", (int) ms);
+	done: FREE(thread_data);
 	*limits = master.limits;
 	return ret;
 	err: ret = -1;
@@ -12,5 +12,8 @@
 
 int dragon_draw_pthread(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
 int dragon_limits_pthread(limits_t *lim, uint64_t size, int nb_thread);
+int dragon_sweep_pthread(struct rgb *image, int width, int height, int power, int power_max,
+		int nb_thread, int render, dragon_frame frame, void *arg);
+int dragon_pthread_schedule(const char *schedule);
 
 #endif /* DRAGON_PTHREAD_H_ */
@@ -0,0 +1,182 @@
+/*
+ * dragon_stl.cpp
+ *
+ * Only uses the standard library. The number of threads is chosen by the
+ * implementation, nb_thread only sets the number of colors and the number
+ * of blocks of work. libstdc++ runs the parallel policies on TBB, and
+ * serially without it: configure defines HAVE_PARALLEL_STL when they run in
+ * parallel.
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+extern "C" {
+#include "dragon.h"
+#include "color.h"
+#include "metrics.h"
+}
+#include "dragon_stl.h"
+#include "dragon_trace.h"
+
+using namespace std;
+
+/* blocks of segments per color */
+#define DRAW_BLOCKS		16
+/* cells cleared per block */
+#define CLEAR_BLOCK		4096
+
+typedef chrono::steady_clock Clock;
+
+/* the threads running the algorithms are unknown, only phases are recorded */
+static int elapsed_ms(Clock::time_point start, enum metrics_phase phase)
+{
+	chrono::duration<double, milli> ms = Clock::now() - start;
+	metrics_phase(phase, ms.count());
+	return ms.count();
+}
+
+/*
+ * Piece of the segments [first, last). transform_reduce may combine values
+ * in any order, so the combiner returns the piece of the smallest range
+ * holding both operands: a gap or an overlap between them is computed with
+ * piece_range(). Values coming from adjacent blocks are simply merged with
+ * piece_merge(), in segment order.
+ */
+struct PieceRange {
+	uint64_t first;
+	uint64_t last;
+	piece_t piece;
+	bool empty;
+
+	PieceRange() : first(0), last(0), empty(true) {
+		piece_init(&piece);
+	}
+	PieceRange(uint64_t first, uint64_t last) : first(first), last(last), empty(false) {
+		piece_init(&piece);
+		TRACE_WORK_BEGIN(METRICS_LIMITS, first, last);
+		piece_limit(first, last, &piece);
+		TRACE_WORK_END(METRICS_LIMITS, first, last);
+	}
+};
+
+static PieceRange hull(PieceRange a, PieceRange b)
+{
+	if (a.empty)
+		return b;
+	if (b.empty)
+		return a;
+	if (b.first < a.first)
+		swap(a, b);
+	if (b.last <= a.last)
+		return a;
+	if (b.first == a.last) {
+		piece_merge(&a.piece, b.piece);
+	} else if (b.first < a.last) {
+		piece_range(a.last, b.last, &a.piece);
+	} else {
+		piece_range(a.last, b.first, &a.piece);
+		piece_merge(&a.piece, b.piece);
+	}
+	a.last = b.last;
+	return a;
+}
+
+int dragon_limits_stl(limits_t *limits, uint64_t size, int nb_thread)
+{
+	uint64_t blocks = min<uint64_t>(size, (uint64_t) nb_thread * DRAW_BLOCKS);
+	vector<uint64_t> index(blocks);
+	iota(index.begin(), index.end(), 0);
+
+	Clock::time_point start = Clock::now();
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, size);
+	PieceRange lim = transform_reduce(execution::par, index.begin(), index.end(),
+			PieceRange(), hull, [=](uint64_t i) {
+				return PieceRange(range_part(size, i, blocks), range_part(size, i + 1, blocks));
+			});
+	TRACE_PHASE_END(METRICS_LIMITS);
+	cout << "Limit calcul time: " << elapsed_ms(start, METRICS_LIMITS) << " milliseconds" << endl;
+	*limits = lim.piece.limits;
+	return 0;
+}
+
+int dragon_draw_stl(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	limits_t limits;
+	char *dragon = NULL;
+
+	struct palette *palette = init_palette(nb_thread);
+	if (palette == NULL)
+		return -1;
+
+	/* 1. Calculer les limites du dragon */
+	dragon_limits_stl(&limits, size, nb_thread);
+	int dragon_width = limits.maximums.x - limits.minimums.x;
+	int dragon_height = limits.maximums.y - limits.minimums.y;
+	uint64_t area = canvas_area(dragon_width, dragon_height);
+
+	dragon = canvas_alloc(area);
+	if (dragon == NULL) {
+		free_palette(palette);
+		*canvas = NULL;
+		return -1;
+	}
+
+	/* 2. Initialiser la surface */
+	vector<uint64_t> clear((area + CLEAR_BLOCK - 1) / CLEAR_BLOCK);
+	iota(clear.begin(), clear.end(), 0);
+	Clock::time_point start = Clock::now();
+	/* no work events, tracepoints may not be called in par_unseq */
+	TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+	for_each(execution::par_unseq, clear.begin(), clear.end(), [=](uint64_t i) {
+		init_canvas(i * CLEAR_BLOCK, min<uint64_t>((i + 1) * CLEAR_BLOCK, area), dragon, -1);
+	});
+	TRACE_PHASE_END(METRICS_CLEAR);
+	cout << "Clear calcul time: " << elapsed_ms(start, METRICS_CLEAR) << " milliseconds" << endl;
+
+	/*
+	 * 3. Dessiner le dragon, chaque couleur en DRAW_BLOCKS blocs
+	 *
+	 * dragon_draw_raw and scale_dragon may print or allocate, which is not
+	 * allowed in par_unseq, so draw and render use par.
+	 */
+	vector<uint64_t> draw((uint64_t) nb_thread * DRAW_BLOCKS);
+	iota(draw.begin(), draw.end(), 0);
+	start = Clock::now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+	for_each(execution::par, draw.begin(), draw.end(), [=](uint64_t i) {
+		int id = i / DRAW_BLOCKS;
+		int k = i % DRAW_BLOCKS;
+		uint64_t first = range_part(size, id, nb_thread);
+		uint64_t last = range_part(size, id + 1, nb_thread);
+		uint64_t begin = first + k * (last - first) / DRAW_BLOCKS;
+		uint64_t end = first + (k + 1) * (last - first) / DRAW_BLOCKS;
+		TRACE_WORK_BEGIN(METRICS_DRAW, begin, end);
+		dragon_draw_raw(begin, end, dragon, dragon_width, dragon_height, limits, id);
+		TRACE_WORK_END(METRICS_DRAW, begin, end);
+	});
+	TRACE_PHASE_END(METRICS_DRAW);
+	cout << "Draw calcul time (" << canvas_layout_name(canvas_layout) << "): "
+			<< elapsed_ms(start, METRICS_DRAW) << " milliseconds" << endl;
+
+	/* 4. Effectuer le rendu final */
+	vector<int> rows(height);
+	iota(rows.begin(), rows.end(), 0);
+	start = Clock::now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
+	for_each(execution::par, rows.begin(), rows.end(), [=](int y) {
+		TRACE_WORK_BEGIN(METRICS_RENDER, y, y + 1);
+		scale_dragon(y, y + 1, image, width, height, dragon, dragon_width, dragon_height, palette);
+		TRACE_WORK_END(METRICS_RENDER, y, y + 1);
+	});
+	TRACE_PHASE_END(METRICS_RENDER);
+	cout << "Render calcul time: " << elapsed_ms(start, METRICS_RENDER) << " milliseconds" << endl;
+
+	free_palette(palette);
+	*canvas = dragon;
+	return 0;
+}
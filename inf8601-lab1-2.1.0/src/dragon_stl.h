@@ -0,0 +1,21 @@
+/*
+ * dragon_stl.h
+ *
+ *  C++17 parallel algorithms implementation of dragonizer
+ */
+
+#ifndef DRAGON_STL_H_
+#define DRAGON_STL_H_
+
+#include "dragon.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+int dragon_draw_stl(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread);
+int dragon_limits_stl(limits_t *limits, uint64_t size, int nb_thread);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DRAGON_STL_H_ */
@@ -8,19 +8,23 @@
 #include <iostream>
 
 extern "C" {
+#include "config.h"
 #include "time.h"
 #include "dragon.h"
 #include "color.h"
 #include "utils.h"
+#include "metrics.h"
 }
+#include "dragon_trace.h"
 #include "dragon_tbb.h"
+
+#ifdef HAVE_LIBTBB
+
 #include "tbb/tbb.h"
 #include "TidMap.h"
-#include <atomic>
 
 using namespace std;
 using namespace tbb;
-atomic_int numberOfInterval;
 static TidMap* tidMap = NULL;
 
 class DragonLimits {
@@ -32,7 +36,9 @@ class DragonLimits {
 			piece_init(&mpiece);
 		}
 		void operator()(const blocked_range<uint64_t>& range){
+			TRACE_WORK_BEGIN(METRICS_LIMITS, range.begin(), range.end());
 			piece_limit(range.begin(),range.end(),&mpiece);
+			TRACE_WORK_END(METRICS_LIMITS, range.begin(), range.end());
 		}
 		void join(DragonLimits& dragon){
 			piece_merge(&mpiece,dragon.mpiece);
@@ -49,23 +55,24 @@ class DragonDraw {
 		DragonDraw(const DragonDraw& dragon){
 			mdata = dragon.mdata;
 		}
-		void operator()(const blocked_range<int>& range) const{
-			tidMap->getIdFromTid(gettid());
-			int indexBegin = ((range.begin() * mdata->nb_thread) / mdata->size);
-			int indexEnd = ((range.end() * mdata->nb_thread) / mdata->size);
-			if(indexBegin != indexEnd)
-			{
-				int begin1 = range.begin();
-				int end1 = (indexEnd * mdata->size / mdata->nb_thread) - 1;
-				int begin2 = end1 + 1;
-				int end2 = range.end();
-				dragon_draw_raw(begin1,end1,mdata->dragon, mdata->dragon_width, mdata->dragon_height,mdata->limits, indexBegin);
-				dragon_draw_raw(begin2,end2,mdata->dragon, mdata->dragon_width, mdata->dragon_height,mdata->limits, indexEnd);
-			}
-			else
-			{
-				dragon_draw_raw(range.begin(),range.end(),mdata->dragon, mdata->dragon_width, mdata->dragon_height,mdata->limits, indexBegin);
+		void operator()(const blocked_range<uint64_t>& range) const{
+			double begin = metrics_now();
+			TRACE_WORK_BEGIN(METRICS_DRAW, range.begin(), range.end());
+			/* the range may span several colors, draw the part of each one */
+			int indexBegin = (unsigned __int128) range.begin() * mdata->nb_thread / mdata->size;
+			int indexEnd = (unsigned __int128) (range.end() - 1) * mdata->nb_thread / mdata->size;
+			for (int index = indexBegin; index <= indexEnd; index++) {
+				uint64_t first = range_part(mdata->size, index, mdata->nb_thread);
+				uint64_t last = range_part(mdata->size, index + 1, mdata->nb_thread);
+				if (first < range.begin())
+					first = range.begin();
+				if (last > range.end())
+					last = range.end();
+				if (first < last)
+					dragon_draw_raw(first, last, mdata->dragon, mdata->dragon_width, mdata->dragon_height, mdata->limits, index);
 			}
+			TRACE_WORK_END(METRICS_DRAW, range.begin(), range.end());
+			tidMap->countDraw(range.size(), metrics_now() - begin);
 			
 				
 		}
@@ -81,8 +88,11 @@ class DragonRender {
 			mdata = dragon.mdata;
 		}
 		void operator()(const blocked_range<int>& range) const{
-			numberOfInterval++;
+			double begin = metrics_now();
+			TRACE_WORK_BEGIN(METRICS_RENDER, range.begin(), range.end());
 			scale_dragon(range.begin(),range.end(),mdata->image,mdata->image_width,mdata->image_height, mdata->dragon, mdata->dragon_width, mdata->dragon_height, mdata->palette);
+			TRACE_WORK_END(METRICS_RENDER, range.begin(), range.end());
+			tidMap->countRender(metrics_now() - begin);
 		}
 	struct draw_data* mdata;
 };
@@ -97,8 +107,12 @@ class DragonClear {
 		 mdefaultValue = dragon.mdefaultValue;
 		 mcanvas = dragon.mcanvas;
 	 }
-	 void operator()(const blocked_range<int>& range) const{
+	 void operator()(const blocked_range<uint64_t>& range) const{
+		 double begin = metrics_now();
+		 TRACE_WORK_BEGIN(METRICS_CLEAR, range.begin(), range.end());
 		 init_canvas(range.begin(),range.end(),mcanvas, mdefaultValue);
+		 TRACE_WORK_END(METRICS_CLEAR, range.begin(), range.end());
+		 tidMap->addBusy(metrics_now() - begin);
 	 }
 		char mdefaultValue;
 		char* mcanvas;
@@ -112,33 +126,32 @@ int dragon_draw_tbb(char **canvas, struct rgb *image, int width, int height, uin
 	char *dragon = NULL;
 	int dragon_width;
 	int dragon_height;
-	int dragon_surface;
-	int scale_x;
-	int scale_y;
-	int scale;
-	int deltaJ;
-	int deltaI;
+	uint64_t dragon_surface;
+	int64_t scale_x;
+	int64_t scale_y;
+	int64_t scale;
+	int64_t deltaJ;
+	int64_t deltaI;
 
 	struct palette *palette = init_palette(nb_thread);
 	if (palette == NULL)
 		return -1;
 
 	/* 1. Calculer les limites du dragon */
-	clock_t start = clock(), diff;
+	double start = metrics_now(), msec;
 	dragon_limits_tbb(&limits, size, nb_thread);
-	diff = clock() - start;
-	int msec = diff * 1000 / CLOCKS_PER_SEC;
-	cout << "Limit calcul time: " << msec << " milliseconds" << endl;
+	msec = metrics_now() - start;
+	cout << "Limit calcul time: " << (int) msec << " milliseconds" << endl;
 	dragon_width = limits.maximums.x - limits.minimums.x;
 	dragon_height = limits.maximums.y - limits.minimums.y;
-	dragon_surface = dragon_width * dragon_height;
+	dragon_surface = canvas_area(dragon_width, dragon_height);
 	scale_x = dragon_width / width + 1;
 	scale_y = dragon_height / height + 1;
 	scale = (scale_x > scale_y ? scale_x : scale_y);
 	deltaJ = (scale * width - dragon_width) / 2;
 	deltaI = (scale * height - dragon_height) / 2;
 
-	dragon = (char *) malloc(dragon_surface);
+	dragon = canvas_alloc(dragon_surface);
 	if (dragon == NULL) {
 		free_palette(palette);
 		*canvas = NULL;
@@ -163,27 +176,33 @@ int dragon_draw_tbb(char **canvas, struct rgb *image, int width, int height, uin
 
 	/* 2. Initialiser la surface : DragonClear */
 	DragonClear dragonClear(-1,dragon);
-	start = clock();
-	parallel_for(blocked_range<int>(0,dragon_surface),dragonClear);
-	diff = clock() - start;
-	msec = diff * 1000 / CLOCKS_PER_SEC;
-	cout << "Clear calcul time: "<< msec << " milliseconds" << endl;
+	start = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_CLEAR, size);
+	parallel_for(blocked_range<uint64_t>(0,dragon_surface),dragonClear);
+	TRACE_PHASE_END(METRICS_CLEAR);
+	msec = metrics_now() - start;
+	metrics_phase(METRICS_CLEAR, msec);
+	cout << "Clear calcul time: "<< (int) msec << " milliseconds" << endl;
 	/* 3. Dessiner le dragon : DragonDraw */
 	DragonDraw dragonDraw(&data);
-	start = clock();
-	parallel_for(blocked_range<int>(0,data.size),dragonDraw);
-	diff = clock() - start;
-	msec = diff * 1000 / CLOCKS_PER_SEC;
-	cout << "Draw calcul time: "<< msec << " milliseconds" << endl;
+	start = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_DRAW, size);
+	parallel_for(blocked_range<uint64_t>(0,data.size),dragonDraw);
+	TRACE_PHASE_END(METRICS_DRAW);
+	msec = metrics_now() - start;
+	metrics_phase(METRICS_DRAW, msec);
+	cout << "Draw calcul time (" << canvas_layout_name(canvas_layout) << "): "<< (int) msec << " milliseconds" << endl;
 	/* 4. Effectuer le rendu final : DragonRender */
 	DragonRender dragonRender(&data);
-	start = clock();
+	start = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_RENDER, size);
 	parallel_for(blocked_range<int>(0,data.image_height),dragonRender);
-	diff = clock() - start;
-	msec = diff * 1000 / CLOCKS_PER_SEC;
-	cout << "Render calcul time: "<< msec << " milliseconds" << endl;
-	cout << "Number of interval: " << numberOfInterval << endl;
+	TRACE_PHASE_END(METRICS_RENDER);
+	msec = metrics_now() - start;
+	metrics_phase(METRICS_RENDER, msec);
+	cout << "Render calcul time: "<< (int) msec << " milliseconds" << endl;
 	tidMap->dump();
+	tidMap->report();
 	init.terminate();
 	free_palette(palette);
 	*canvas = dragon;
@@ -199,8 +218,29 @@ int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread)
 {
 	DragonLimits lim;
 	task_scheduler_init task(nb_thread);
+	double start = metrics_now();
+	TRACE_PHASE_BEGIN(METRICS_LIMITS, size);
 	parallel_reduce(blocked_range<uint64_t>(0,size),lim);
+	TRACE_PHASE_END(METRICS_LIMITS);
 	piece_t piece = lim.getPiece();
 	*limits = piece.limits;
+	metrics_phase(METRICS_LIMITS, metrics_now() - start);
 	return 0;
 }
+
+#else /* HAVE_LIBTBB */
+
+int dragon_draw_tbb(char **canvas, struct rgb *image, int width, int height, uint64_t size, int nb_thread)
+{
+	std::cerr << "TBB is not available" << std::endl;
+	*canvas = NULL;
+	return -1;
+}
+
+int dragon_limits_tbb(limits_t *limits, uint64_t size, int nb_thread)
+{
+	std::cerr << "TBB is not available" << std::endl;
+	return -1;
+}
+
+#endif /* HAVE_LIBTBB */
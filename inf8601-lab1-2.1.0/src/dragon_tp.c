@@ -0,0 +1,14 @@
+/*
+ * dragon_tp.c
+ *
+ *  Probes of the LTTng-UST provider, empty unless configured with
+ *  --enable-lttng
+ */
+
+#include "config.h"
+
+#ifdef HAVE_LIBLTTNG_UST
+#define TRACEPOINT_CREATE_PROBES
+#define TRACEPOINT_DEFINE
+#include "dragon_tp.h"
+#endif
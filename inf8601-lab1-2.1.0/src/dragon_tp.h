@@ -0,0 +1,58 @@
+/*
+ * dragon_tp.h
+ *
+ *  LTTng-UST tracepoint provider of dragonizer, used through dragon_trace.h
+ *
+ *  phase_begin/phase_end wrap a whole phase on the thread driving it,
+ *  work_begin/work_end wrap each range of a phase run by a worker: segments
+ *  for limits and draw, cells for clear and rows for render. Phases are the
+ *  values of enum metrics_phase.
+ */
+
+#undef TRACEPOINT_PROVIDER
+#define TRACEPOINT_PROVIDER dragon
+
+#undef TRACEPOINT_INCLUDE
+#define TRACEPOINT_INCLUDE "./dragon_tp.h"
+
+#if !defined(DRAGON_TP_H_) || defined(TRACEPOINT_HEADER_MULTI_READ)
+#define DRAGON_TP_H_
+
+#include <stdint.h>
+#include <lttng/tracepoint.h>
+
+TRACEPOINT_EVENT(dragon, phase_begin,
+	TP_ARGS(int, phase, uint64_t, size),
+	TP_FIELDS(
+		ctf_integer(int, phase, phase)
+		ctf_integer(uint64_t, size, size)
+	)
+)
+
+TRACEPOINT_EVENT(dragon, phase_end,
+	TP_ARGS(int, phase),
+	TP_FIELDS(
+		ctf_integer(int, phase, phase)
+	)
+)
+
+TRACEPOINT_EVENT_CLASS(dragon, work,
+	TP_ARGS(int, phase, uint64_t, start, uint64_t, end),
+	TP_FIELDS(
+		ctf_integer(int, phase, phase)
+		ctf_integer(uint64_t, start, start)
+		ctf_integer(uint64_t, end, end)
+	)
+)
+
+TRACEPOINT_EVENT_INSTANCE(dragon, work, work_begin,
+	TP_ARGS(int, phase, uint64_t, start, uint64_t, end)
+)
+
+TRACEPOINT_EVENT_INSTANCE(dragon, work, work_end,
+	TP_ARGS(int, phase, uint64_t, start, uint64_t, end)
+)
+
+#endif /* DRAGON_TP_H_ */
+
+#include <lttng/tracepoint-event.h>
@@ -0,0 +1,67 @@
+/*
+ * dragon_trace.h
+ *
+ *  Static tracepoints of the dragonizer phases
+ *
+ *  With --enable-lttng, the events of the dragon provider of dragon_tp.h.
+ *  Otherwise, USDT probes when sys/sdt.h is available, which cost a nop and
+ *  can be used by perf, bpftrace or systemtap. Otherwise, nothing.
+ *
+ *  The work events also sample the hardware counters of perfctr.h when
+ *  --perf-counters is given, whatever the tracer.
+ */
+
+#ifndef DRAGON_TRACE_H_
+#define DRAGON_TRACE_H_
+
+#include "config.h"
+#include "perfctr.h"
+
+#if defined(HAVE_LIBLTTNG_UST)
+
+#include "dragon_tp.h"
+
+#define TRACE_PHASE_BEGIN(phase, size) \
+	tracepoint(dragon, phase_begin, phase, size)
+#define TRACE_PHASE_END(phase) \
+	tracepoint(dragon, phase_end, phase)
+#define TP_WORK_BEGIN(phase, start, end) \
+	tracepoint(dragon, work_begin, phase, start, end)
+#define TP_WORK_END(phase, start, end) \
+	tracepoint(dragon, work_end, phase, start, end)
+
+#elif defined(HAVE_SYS_SDT_H)
+
+#include <sys/sdt.h>
+
+#define TRACE_PHASE_BEGIN(phase, size) \
+	DTRACE_PROBE2(dragon, phase_begin, phase, size)
+#define TRACE_PHASE_END(phase) \
+	DTRACE_PROBE1(dragon, phase_end, phase)
+#define TP_WORK_BEGIN(phase, start, end) \
+	DTRACE_PROBE3(dragon, work_begin, phase, start, end)
+#define TP_WORK_END(phase, start, end) \
+	DTRACE_PROBE3(dragon, work_end, phase, start, end)
+
+#else
+
+#define TRACE_PHASE_BEGIN(phase, size) do { } while (0)
+#define TRACE_PHASE_END(phase) do { } while (0)
+#define TP_WORK_BEGIN(phase, start, end) do { } while (0)
+#define TP_WORK_END(phase, start, end) do { } while (0)
+
+#endif
+
+#define TRACE_WORK_BEGIN(phase, start, end) do {	\
+	TP_WORK_BEGIN(phase, start, end);			\
+	if (perfctr_enabled)						\
+		perfctr_begin(phase);					\
+} while (0)
+
+#define TRACE_WORK_END(phase, start, end) do {	\
+	if (perfctr_enabled)						\
+		perfctr_end(phase);						\
+	TP_WORK_END(phase, start, end);				\
+} while (0)
+
+#endif /* DRAGON_TRACE_H_ */
@@ -0,0 +1,274 @@
+/*
+ * dragonbench.c
+ *
+ * Microbenchmarks of the dragon kernels, run with "make bench".
+ *
+ * Each kernel is timed alone, on one pinned thread, for a few sizes. A
+ * measure repeats the kernel until it lasts at least BENCH_MIN_NS and the
+ * best of BENCH_RUNS measures is reported, per segment, per pixel or per
+ * byte depending on the kernel. "dragonbench nibble" runs them on a packed
+ * canvas.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include "dragon.h"
+#include "color.h"
+
+#define BENCH_MIN_NS	50000000ULL
+#define BENCH_RUNS		5
+#define BENCH_COLORS	8
+#define IMAGE_SIZE		512
+/* calls of the per-segment functions, spread over the segments */
+#define BENCH_CALLS		(1 << 16)
+
+struct kernel_ctx {
+	uint64_t size;
+	uint64_t calls;
+	limits_t limits;
+	int width;
+	int height;
+	char *canvas;
+	struct rgb *image;
+	struct palette *palette;
+	piece_t piece;
+};
+
+typedef void (*kernel_fn)(struct kernel_ctx *ctx);
+
+struct kernel_def {
+	const char *name;
+	const char *unit;
+	kernel_fn run;
+	/* operations and bytes per run, to normalize the time */
+	uint64_t (*ops)(struct kernel_ctx *ctx);
+	uint64_t (*bytes)(struct kernel_ctx *ctx);
+};
+
+/* results the compiler must assume are read */
+static volatile int64_t sink;
+
+/* keep the stores to p, the compiler must assume the memory is read */
+static inline void escape(void *p)
+{
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_piece_limit(struct kernel_ctx *ctx)
+{
+	piece_t piece;
+	piece_init(&piece);
+	piece_limit(0, ctx->size, &piece);
+	sink = piece.limits.maximums.x;
+}
+
+static void run_piece_merge(struct kernel_ctx *ctx)
+{
+	piece_t piece;
+	uint64_t i;
+	piece_init(&piece);
+	for (i = 0; i < ctx->calls; i++) {
+		escape(&ctx->piece);
+		piece_merge(&piece, ctx->piece);
+	}
+	sink = piece.limits.maximums.x;
+}
+
+static void run_compute_position(struct kernel_ctx *ctx)
+{
+	int64_t acc = 0;
+	uint64_t i;
+	for (i = 0; i < ctx->calls; i++) {
+		xy_t xy = compute_position(i * (ctx->size / ctx->calls));
+		acc += xy.x ^ xy.y;
+	}
+	sink = acc;
+}
+
+static void run_compute_orientation(struct kernel_ctx *ctx)
+{
+	int64_t acc = 0;
+	uint64_t i;
+	for (i = 0; i < ctx->calls; i++) {
+		xy_t xy = compute_orientation(i * (ctx->size / ctx->calls));
+		acc += xy.x ^ xy.y;
+	}
+	sink = acc;
+}
+
+static void run_draw_raw(struct kernel_ctx *ctx)
+{
+	dragon_draw_raw(0, ctx->size, ctx->canvas, ctx->width, ctx->height, ctx->limits, 0);
+	escape(ctx->canvas);
+}
+
+static void run_scale_dragon(struct kernel_ctx *ctx)
+{
+	scale_dragon(0, IMAGE_SIZE, ctx->image, IMAGE_SIZE, IMAGE_SIZE, ctx->canvas,
+			ctx->width, ctx->height, ctx->palette);
+	escape(ctx->image);
+}
+
+static void run_init_canvas(struct kernel_ctx *ctx)
+{
+	init_canvas(0, canvas_area(ctx->width, ctx->height), ctx->canvas, -1);
+	escape(ctx->canvas);
+}
+
+static uint64_t ops_segments(struct kernel_ctx *ctx)
+{
+	return ctx->size;
+}
+
+static uint64_t ops_calls(struct kernel_ctx *ctx)
+{
+	return ctx->calls;
+}
+
+static uint64_t ops_pixels(__attribute__((unused)) struct kernel_ctx *ctx)
+{
+	return (uint64_t) IMAGE_SIZE * IMAGE_SIZE;
+}
+
+static uint64_t bytes_canvas(struct kernel_ctx *ctx)
+{
+	return canvas_bytes(canvas_area(ctx->width, ctx->height));
+}
+
+static uint64_t bytes_none(__attribute__((unused)) struct kernel_ctx *ctx)
+{
+	return 0;
+}
+
+static const struct kernel_def kernels[] = {
+		{ "piece_limit", "segment", run_piece_limit, ops_segments, bytes_none },
+		{ "piece_merge", "merge", run_piece_merge, ops_calls, bytes_none },
+		{ "compute_position", "call", run_compute_position, ops_calls, bytes_none },
+		{ "compute_orientation", "call", run_compute_orientation, ops_calls, bytes_none },
+		{ "dragon_draw_raw", "segment", run_draw_raw, ops_segments, bytes_none },
+		{ "scale_dragon", "pixel", run_scale_dragon, ops_pixels, bytes_canvas },
+		{ "init_canvas", "cell", run_init_canvas, bytes_canvas, bytes_canvas },
+		{ NULL, NULL, NULL, NULL, NULL },
+};
+
+static int ctx_init(struct kernel_ctx *ctx, int power)
+{
+	memset(ctx, 0, sizeof(struct kernel_ctx));
+	ctx->size = 1ULL << power;
+	ctx->calls = ctx->size < BENCH_CALLS ? ctx->size : BENCH_CALLS;
+	if (dragon_limits_table(&ctx->limits, ctx->size, 1) < 0)
+		return -1;
+	ctx->width = ctx->limits.maximums.x - ctx->limits.minimums.x;
+	ctx->height = ctx->limits.maximums.y - ctx->limits.minimums.y;
+	piece_init(&ctx->piece);
+	piece_limit(0, 1, &ctx->piece);
+	if ((ctx->canvas = (char *) malloc(canvas_bytes(canvas_area(ctx->width, ctx->height)))) == NULL)
+		return -1;
+	if ((ctx->image = make_canvas(IMAGE_SIZE, IMAGE_SIZE)) == NULL)
+		return -1;
+	if ((ctx->palette = init_palette(BENCH_COLORS)) == NULL)
+		return -1;
+	/* scale_dragon reads a drawn canvas, like in dragonizer */
+	init_canvas(0, canvas_area(ctx->width, ctx->height), ctx->canvas, -1);
+	dragon_draw_raw(0, ctx->size, ctx->canvas, ctx->width, ctx->height, ctx->limits, 0);
+	return 0;
+}
+
+static void ctx_free(struct kernel_ctx *ctx)
+{
+	FREE(ctx->canvas);
+	FREE(ctx->image);
+	free_palette(ctx->palette);
+	ctx->palette = NULL;
+}
+
+/* best time of one run of the kernel, in nanoseconds */
+static double bench_kernel(const struct kernel_def *k, struct kernel_ctx *ctx)
+{
+	double best = 0;
+	int r;
+
+	/* warmup, also faults the pages in */
+	k->run(ctx);
+	for (r = 0; r < BENCH_RUNS; r++) {
+		uint64_t iter = 0;
+		uint64_t begin = now_ns(), elapsed;
+		do {
+			k->run(ctx);
+			iter++;
+			elapsed = now_ns() - begin;
+		} while (elapsed < BENCH_MIN_NS);
+		if (r == 0 || (double) elapsed / iter < best)
+			best = (double) elapsed / iter;
+	}
+	return best;
+}
+
+/* run on the current cpu only, so that timings do not include migrations */
+static int pin_thread(void)
+{
+	cpu_set_t set;
+	int cpu = sched_getcpu();
+
+	if (cpu < 0)
+		return -1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		return -1;
+	return cpu;
+}
+
+int main(int argc, char **argv)
+{
+	static const int powers[] = { 12, 16, 20, 24 };
+	struct kernel_ctx ctx;
+	int cpu;
+	int p, i;
+
+	if (argc > 2 || (argc == 2 && strcmp(argv[1], "byte") != 0 &&
+			strcmp(argv[1], "nibble") != 0)) {
+		fprintf(stderr, "Usage: %s [ byte | nibble ]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	canvas_packed = argc == 2 && strcmp(argv[1], "nibble") == 0;
+
+	cpu = pin_thread();
+	if (cpu < 0)
+		printf("warning: thread not pinned\n");
+	else
+		printf("pinned on cpu %d\n", cpu);
+
+	printf("%-20s %10s %12s %10s %12s\n", "kernel", "size", "ns/op", "op", "MB/s");
+	for (p = 0; p < (int) (sizeof(powers) / sizeof(powers[0])); p++) {
+		if (ctx_init(&ctx, powers[p]) < 0) {
+			printf("init error at power %d\n", powers[p]);
+			ctx_free(&ctx);
+			return EXIT_FAILURE;
+		}
+		for (i = 0; kernels[i].name != NULL; i++) {
+			const struct kernel_def *k = &kernels[i];
+			double ns = bench_kernel(k, &ctx);
+			uint64_t bytes = k->bytes(&ctx);
+			printf("%-20s %10" PRIu64 " %12.3f %10s", k->name, ctx.size,
+					ns / k->ops(&ctx), k->unit);
+			if (bytes > 0)
+				printf(" %12.1f", bytes / ns * 1000);
+			printf("\n");
+		}
+		ctx_free(&ctx);
+	}
+	return EXIT_SUCCESS;
+}
@@ -19,11 +19,19 @@
 #include <error.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <math.h>
 
 #include "config.h"
 #include "dragon.h"
 #include "dragon_pthread.h"
 #include "dragon_tbb.h"
+#include "dragon_openmp.h"
+#include "dragon_stl.h"
+#include "dragon_mpi.h"
+#include "metrics.h"
+#include "perfctr.h"
+#include "encode.h"
+#include "writer.h"
 
 /* Globals and defaults */
 #define PROGNAME "dragonizer"
@@ -33,15 +41,28 @@
 #define DEFAULT_NB_THREAD 2
 #define DEFAULT_LIB_NAME "serial"
 #define DEFAULT_IMG_PATH "dragon.ppm"
-#define POWER_MAX 		30
+#define POWER_MAX 		60
 #define CHECK_POWER 	20
 #define CHECK_NB_THREAD	8
+/* powers grown by the sweep of check */
+#define CHECK_SWEEP_POWERS	4
+#define BENCH_REPEAT	5
+#define BENCH_WARMUP	1
+#define DEFAULT_BASELINE "perf-baseline.txt"
+#define PERF_BASELINE_VERSION	1
+#define PERF_TOLERANCE	10
+/* double buffering of the frames: one drawn while the other is written */
+#define WRITE_BUFFERS	2
+/* timings of the baseline under this median are not compared */
+#define PERF_MIN_MS		1.0
 static const struct command_def const *commands[];
 int verbose = 0;
 
 /*
- * Over POWER_MAX = 30, the types used in array indexes overflows
- * and memory usage is very high, limiting power to 2^29
+ * Indexes and areas are 64 bits. The canvas width and height are int: at
+ * POWER_MAX = 60 the dragon is 2^31 - 1 cells wide, so the arithmetic on them
+ * (tiles, scale factors) is done in 64 bits. Canvases larger than the memory
+ * are mapped from a file.
  * */
 
 enum thread_lib {
@@ -49,6 +70,17 @@ enum thread_lib {
 	THREAD_LIB_SERIAL,
 	THREAD_LIB_PTHREAD,
 	THREAD_LIB_TBB,
+	THREAD_LIB_TABLE,
+	THREAD_LIB_STREAM,
+	THREAD_LIB_OPENMP,
+	THREAD_LIB_STL,
+	THREAD_LIB_MPI,
+};
+
+enum canvas_packing {
+	PACKING_AUTO,
+	PACKING_BYTE,
+	PACKING_NIBBLE,
 };
 
 struct command_opts {
@@ -62,16 +94,33 @@ struct command_opts {
 	int power_max;
 	int verbose;
 	uint64_t size;
+	enum metrics_format stats;
+	int all_libs;
+	int repeat;
+	int warmup;
+	char *baseline;
+	double tolerance;
+	int update;
+	int mmap;
+	int layout_set;
+	enum canvas_packing packing;
+	int incremental;
+	int frames;
+	int write_buffers;
+	int viewport_set;
+	limits_t viewport;
 };
 
 typedef int (*draw_handler)(char **, struct rgb *, int, int, uint64_t, int);
 typedef int (*limits_handler)(limits_t *, uint64_t, int);
+typedef int (*sweep_handler)(struct rgb *, int, int, int, int, int, int, dragon_frame, void *);
 
 struct lib_def {
 	const char *name;
 	enum thread_lib lib;
 	draw_handler draw_handler;
 	limits_handler limits_handler;
+	sweep_handler sweep_handler;
 };
 
 static const struct lib_def libs[] = {
@@ -82,11 +131,36 @@ static const struct lib_def libs[] = {
 		{ .name = "pthread",
 				.lib = THREAD_LIB_PTHREAD,
 				.draw_handler = dragon_draw_pthread,
-				.limits_handler = dragon_limits_pthread },
+				.limits_handler = dragon_limits_pthread,
+				.sweep_handler = dragon_sweep_pthread },
+#ifdef HAVE_LIBTBB
 		{ .name = "tbb",
 				.lib = THREAD_LIB_TBB,
 				.draw_handler = dragon_draw_tbb,
 				.limits_handler = dragon_limits_tbb },
+#endif
+		{ .name = "table",
+				.lib = THREAD_LIB_TABLE,
+				.draw_handler = dragon_draw_table,
+				.limits_handler = dragon_limits_table },
+		{ .name = "stream",
+				.lib = THREAD_LIB_STREAM,
+				.draw_handler = dragon_draw_stream,
+				.limits_handler = dragon_limits_table },
+		{ .name = "openmp",
+				.lib = THREAD_LIB_OPENMP,
+				.draw_handler = dragon_draw_openmp,
+				.limits_handler = dragon_limits_openmp },
+		{ .name = "stl",
+				.lib = THREAD_LIB_STL,
+				.draw_handler = dragon_draw_stl,
+				.limits_handler = dragon_limits_stl },
+#ifdef HAVE_MPI
+		{ .name = "mpi",
+				.lib = THREAD_LIB_MPI,
+				.draw_handler = dragon_draw_mpi,
+				.limits_handler = dragon_limits_mpi },
+#endif
 		{ .name = NULL,
 				.lib = THREAD_LIB_NONE,
 				.draw_handler = NULL,
@@ -107,27 +181,145 @@ static void usage(void)
 	fprintf(stderr, "Usage: " PROGNAME " [OPTIONS] [COMMAND]\n");
 	fprintf(stderr, "\nOptions:\n");
 	fprintf(stderr, "  --help	this help\n");
-	fprintf(stderr, "  --cmd		command [ draw | limits | check ]\n");
+	fprintf(stderr, "  --cmd		command [ draw | limits | check | bench | perfcheck ]\n");
 	fprintf(stderr, "  --thread	set number of threads\n");
 	fprintf(stderr, "  --lib		set the threading library to use "\
-			"[ serial | pthread | tbb ]\n");
-	fprintf(stderr, "  --output set image path output\n");
+			"[ serial | pthread | tbb | table | stream | openmp | stl | mpi ]\n");
+	fprintf(stderr, "  --output set image path output, encoded by extension [ .ppm | .qoi | .png ]\n");
+	fprintf(stderr, "  --mmap	render the image directly in the mapped output file\n");
 	fprintf(stderr, "  --height	set dragon height\n");
 	fprintf(stderr, "  --width	set dragon width\n");
 	fprintf(stderr, "  --size	set dragon size\n");
 	fprintf(stderr, "  --power  set dragon size by power\n");
 	fprintf(stderr, "  --max    compute all dragon to max power\n");
+	fprintf(stderr, "  --incremental	draw: grow each power from the previous one (pthread)\n");
+	fprintf(stderr, "  --frames	draw: also write the image of each power to <output>-<power>\n");
+	fprintf(stderr, "  --write-buffers	draw: images of the frames writer, 0 writes them in turn "\
+			"(default 2)\n");
+	fprintf(stderr, "  --viewport	draw: only the cells x0,y0,x1,y1 of the dragon, "\
+			"at full resolution, serially (--thread sets the colors)\n");
+	fprintf(stderr, "  --layout	set the dragon canvas layout [ linear | tiled ]\n");
+	fprintf(stderr, "  --packing	set the cells of the canvas [ auto | byte | nibble ], auto "\
+			"packs two cells per byte up to %d threads when the canvas does not fit "\
+			"in memory\n", CANVAS_PACKED_COLORS);
+	fprintf(stderr, "  --canvas-memory	map the canvases larger than this in MB from a file "\
+			"(default half of the memory, tiled layout)\n");
+	fprintf(stderr, "  --canvas-dir	directory of the mapped canvas files\n");
+	fprintf(stderr, "  --schedule	set the openmp loop schedule "\
+			"[ static | dynamic | guided ][,chunk]\n");
+	fprintf(stderr, "  --pthread-schedule	set the pthread schedule "\
+			"[ static | dynamic[,chunks per thread] ]\n");
+	fprintf(stderr, "  --mpi-draw	draw each rank range in the pixel sums or in a band of "\
+			"the canvas [ scaled | band ]\n");
+	fprintf(stderr, "  --stats	print the metrics of each run [ json | csv ]\n");
+	fprintf(stderr, "  --perf-counters	print the hardware counters of each phase and thread\n");
+	fprintf(stderr, "  --repeat	bench: measured runs per configuration\n");
+	fprintf(stderr, "  --warmup	bench: unmeasured runs per configuration\n");
+	fprintf(stderr, "  --baseline	perfcheck: baseline file\n");
+	fprintf(stderr, "  --tolerance	perfcheck: allowed slowdown in percent\n");
+	fprintf(stderr, "  --update	perfcheck: write the baseline instead of checking it\n");
 	fprintf(stderr, "\n");
 	exit(EXIT_FAILURE);
 }
 
+/* output path of the image of a power: dragon.png gives dragon-<power>.png */
+static char *frame_path(const char *path, int power)
+{
+	const char *dot = strrchr(path, '.');
+	const char *slash = strrchr(path, '/');
+	char *frame;
+
+	if (dot == NULL || (slash != NULL && dot < slash))
+		dot = path + strlen(path);
+	if (asprintf(&frame, "%.*s-%d%s", (int) (dot - path), path, power, dot) < 0)
+		return NULL;
+	return frame;
+}
+
+/*
+ * Write the image of a power to its frame file. With a writer, the image is
+ * queued and *img becomes another buffer of the writer, for the next power.
+ */
+static int write_frame(struct command_opts *opts, struct writer *writer, struct rgb **img,
+		int power)
+{
+	char *path;
+	long written;
+
+	if ((path = frame_path(opts->pgm_path, power)) == NULL)
+		return -1;
+	if (writer != NULL) {
+		if (writer_submit(writer, *img, path) < 0)
+			return -1;
+		*img = power == opts->power_max ? NULL : writer_buffer(writer);
+		return 0;
+	}
+	written = encode_img(*img, path, opts->width, opts->height, opts->nb_thread);
+	FREE(path);
+	return written < 0 ? -1 : 0;
+}
+
+struct sweep_frame {
+	struct command_opts *opts;
+	struct writer *writer;
+	/* image the sweep renders in, another buffer of the writer after each frame */
+	struct rgb *img;
+};
+
+/* report each power of an incremental sweep, the last one is written by cmd_draw */
+static int sweep_frame(int power, struct rgb **image, void *arg)
+{
+	struct sweep_frame *sweep = (struct sweep_frame *) arg;
+	struct command_opts *opts = sweep->opts;
+
+	if (opts->frames && power != opts->power_max &&
+			write_frame(opts, sweep->writer, image, power) < 0)
+		return -1;
+	sweep->img = *image;
+	if (power != opts->power_max) {
+		metrics_report(stdout, opts->stats, opts->lib->name, 1ULL << power, opts->nb_thread);
+		metrics_reset();
+	}
+	return 0;
+}
+
+/*
+ * the lib draws the whole dragon, --viewport only the blocks of segments it
+ * shows, serially: nb_thread is the number of colors of the libs
+ */
+static int draw_dragon(struct command_opts *opts, char **dragon, struct rgb *img, uint64_t size)
+{
+	if (opts->viewport_set)
+		return dragon_draw_viewport(dragon, img, opts->width, opts->height, size,
+				opts->nb_thread, &opts->viewport);
+	return opts->lib->draw_handler(dragon, img, opts->width, opts->height, size,
+			opts->nb_thread);
+}
+
 static int cmd_draw(struct command_opts *opts)
 {
 	char *dragon = NULL;
-	struct rgb *img;
+	struct rgb *img = NULL;
+	struct writer *writer = NULL;
+	uint64_t size = opts->size;
 	int ret = 0;
 
-	img = make_canvas(opts->width, opts->height);
+	if (opts->mmap && image_format_of(opts->pgm_path) != IMAGE_PPM) {
+		printf("Error: --mmap only writes PPM images\n");
+		return -1;
+	}
+	/* the frames are written by the writer thread while the next power is drawn */
+	if (opts->frames && !opts->mmap && opts->write_buffers > 0) {
+		writer = writer_create(opts->width, opts->height, opts->write_buffers,
+				opts->nb_thread);
+		if (writer == NULL)
+			goto err;
+		img = writer_buffer(writer);
+	} else if (opts->mmap) {
+		img = make_canvas_mapped(opts->pgm_path, opts->width, opts->height);
+	} else {
+		img = make_canvas(opts->width, opts->height);
+	}
 	if (img == NULL)
 		goto err;
 
@@ -135,24 +327,44 @@ static int cmd_draw(struct command_opts *opts)
 	case THREAD_LIB_SERIAL:
 	case THREAD_LIB_PTHREAD:
 	case THREAD_LIB_TBB:
-		if (opts->power > 0 && opts->power_max > 0) {
+	case THREAD_LIB_TABLE:
+	case THREAD_LIB_STREAM:
+	case THREAD_LIB_OPENMP:
+	case THREAD_LIB_STL:
+	case THREAD_LIB_MPI:
+		if (opts->incremental) {
+			struct sweep_frame sweep = { .opts = opts, .writer = writer, .img = img };
+			size = 1LL << opts->power_max;
+			metrics_reset();
+			ret = opts->lib->sweep_handler(img, opts->width, opts->height, opts->power,
+					opts->power_max, opts->nb_thread, opts->frames, sweep_frame, &sweep);
+			/* the last power is rendered in the buffer of the last frame */
+			img = sweep.img;
+		} else if (opts->power > 0 && opts->power_max > 0) {
 			int i;
 			for (i = opts->power; i <= opts->power_max; i++) {
-				uint64_t size = 1LL << i;
+				size = 1LL << i;
 				if (opts->verbose)
 					printf("draw size=%"PRId64"\n", size);
-				ret = opts->lib->draw_handler(&dragon, img, opts->width, opts->height,
-						size, opts->nb_thread);
-				if (i != opts->power_max)
-					FREE(dragon);
+				metrics_reset();
+				ret = draw_dragon(opts, &dragon, img, size);
 				if (ret < 0)
 					break;
+				/* the image of the last power is written below */
+				if (i != opts->power_max) {
+					if (opts->frames && (ret = write_frame(opts, writer, &img, i)) < 0)
+						break;
+					canvas_release(dragon);
+					dragon = NULL;
+					metrics_report(stdout, opts->stats, opts->lib->name, size,
+							opts->nb_thread);
+				}
 			}
 		} else {
 			if (opts->verbose)
 				printf("draw size=%"PRId64"\n", opts->size);
-			ret = opts->lib->draw_handler(&dragon, img, opts->width, opts->height, opts->size,
-				opts->nb_thread);
+			metrics_reset();
+			ret = draw_dragon(opts, &dragon, img, opts->size);
 		}
 		break;
 	case THREAD_LIB_NONE:
@@ -162,11 +374,45 @@ static int cmd_draw(struct command_opts *opts)
 	}
 	if (ret < 0)
 		goto err;
+	/* only rank 0 of the mpi lib has the image */
+	if (!dragon_mpi_root())
+		goto done;
 
-	write_img(img, opts->pgm_path, opts->width, opts->height);
+	/* a mapped image is already in the file, the write phase is the unmap */
+	double begin = metrics_now(), msec;
+	long written;
+	if (opts->mmap) {
+		/* no writer with --mmap, the last frame is encoded before the unmap */
+		if (opts->frames && write_frame(opts, NULL, &img, opts->power_max) < 0)
+			goto err;
+		free_canvas_mapped(img, opts->width, opts->height);
+		img = NULL;
+		written = 0;
+	} else {
+		written = encode_img(img, opts->pgm_path, opts->width, opts->height, opts->nb_thread);
+		if (written < 0)
+			goto err;
+	}
+	msec = metrics_now() - begin;
+	/* throughput of the raw pixels, comparable between the formats */
+	printf("Write time (%s): %d milliseconds, %.1f MB/s, %ld bytes\n",
+			opts->mmap ? "mmap" : image_format_name(image_format_of(opts->pgm_path)),
+			(int) msec, sizeof(struct rgb) * opts->width * opts->height / msec / 1000,
+			written);
+	if (opts->frames && !opts->mmap && write_frame(opts, writer, &img, opts->power_max) < 0)
+		goto err;
+	if (writer != NULL && writer_finish(writer) < 0)
+		goto err;
+	metrics_phase(METRICS_WRITE, metrics_now() - begin);
+	metrics_report(stdout, opts->stats, opts->lib->name, size, opts->nb_thread);
 done:
-	FREE(dragon);
-	FREE(img);
+	canvas_release(dragon);
+	if (writer != NULL)
+		writer_free(writer);
+	else if (opts->mmap)
+		free_canvas_mapped(img, opts->width, opts->height);
+	else
+		FREE(img);
 	return ret;
 err:
 	ret = -1;
@@ -186,20 +432,31 @@ static int cmd_limits(struct command_opts *opts)
 	case THREAD_LIB_SERIAL:
 	case THREAD_LIB_PTHREAD:
 	case THREAD_LIB_TBB:
+	case THREAD_LIB_TABLE:
+	case THREAD_LIB_STREAM:
+	case THREAD_LIB_OPENMP:
+	case THREAD_LIB_STL:
+	case THREAD_LIB_MPI:
 		if (opts->power > 0 && opts->power_max > 0) {
 			int i;
 			for (i = opts->power; i <= opts->power_max; i++) {
 				uint64_t size = 1LL << i;
 				if (opts->verbose)
 					printf("limits size=%"PRId64"\n", size);
+				metrics_reset();
 				ret = opts->lib->limits_handler(&limits, size, opts->nb_thread);
 				if (ret < 0)
 					break;
+				metrics_report(stdout, opts->stats, opts->lib->name, size, opts->nb_thread);
 			}
 		} else {
 			if (opts->verbose)
 				printf("limits size=%"PRId64"\n", opts->size);
+			metrics_reset();
 			ret = opts->lib->limits_handler(&limits, opts->size, opts->nb_thread);
+			if (ret == 0)
+				metrics_report(stdout, opts->stats, opts->lib->name, opts->size,
+						opts->nb_thread);
 		}
 		break;
 	case THREAD_LIB_NONE:
@@ -253,12 +510,120 @@ static int check_limits(struct command_opts *opts)
 	return ret;
 }
 
+/* pixels drawn in one image and white in the other */
+static int cmp_coverage(struct rgb *exp, struct rgb *act, int width, int height)
+{
+	int i, sum = 0;
+
+	for (i = 0; i < width * height; i++) {
+		int e = exp[i].r != white.r || exp[i].g != white.g || exp[i].b != white.b;
+		int a = act[i].r != white.r || act[i].g != white.g || act[i].b != white.b;
+		sum += e != a;
+	}
+	return sum;
+}
+
+static int check_frame(__attribute__((unused)) int power,
+		__attribute__((unused)) struct rgb **image, __attribute__((unused)) void *arg)
+{
+	return 0;
+}
+
+/*
+ * The sweeps split the colors over the new segments of each power, only the
+ * drawn pixels of their last power match the fresh draw img_exp.
+ */
+static int check_sweep(struct command_opts *opts, struct rgb *img_exp, struct rgb *img_act,
+		int threshold)
+{
+	char *fmt = "%s %10s %10s threshold=%d gap=%d (%.3f%%)\n";
+	int power = 63 - __builtin_clzll(opts->size);
+	int ret = 0;
+	int i;
+
+	/* the sweeps go from power to power */
+	if (opts->size & (opts->size - 1))
+		return 0;
+	for (i = 1; libs[i].lib != THREAD_LIB_NONE; i++) {
+		if (libs[i].sweep_handler == NULL)
+			continue;
+		if (libs[i].sweep_handler(img_act, opts->width, opts->height,
+				power > CHECK_SWEEP_POWERS ? power - CHECK_SWEEP_POWERS : 1, power,
+				opts->nb_thread, 0, check_frame, NULL) < 0) {
+			printf("Error executing sweep with %s\n", libs[i].name);
+			return -1;
+		}
+		int gap = cmp_coverage(img_exp, img_act, opts->width, opts->height);
+		float gap_f = gap * 100 / ((float) opts->width * opts->height);
+		if (gap < threshold) {
+			printf(fmt, "PASS", "sweep", libs[i].name, threshold, gap, gap_f);
+		} else {
+			ret = -1;
+			printf(fmt, "FAIL", "sweep", libs[i].name, threshold, gap, gap_f);
+		}
+	}
+	return ret;
+}
+
+/* formats of encode_img, the PPM first */
+static const char *check_formats[] = { ".ppm", ".qoi", ".png" };
+
+/*
+ * Encode the image in each format on the workers of --thread, in stripes of
+ * a few rows for the image sizes of the tests, and compare the decoded
+ * pixels with those of the PPM.
+ */
+static int check_encode(struct command_opts *opts, struct rgb *img)
+{
+	size_t len = sizeof(struct rgb) * opts->width * opts->height;
+	struct rgb *ppm = NULL;
+	char base[64], file[80];
+	int ret = 0;
+	int fd, i;
+
+	snprintf(base, sizeof(base), "%s/dragon_check_XXXXXX", P_tmpdir);
+	if ((fd = mkstemp(base)) < 0) {
+		perror(base);
+		return -1;
+	}
+	close(fd);
+	for (i = 0; i < (int) (sizeof(check_formats) / sizeof(check_formats[0])); i++) {
+		const char *name = image_format_name(image_format_of(check_formats[i]));
+		struct rgb *dec = NULL;
+		int width = 0, height = 0;
+#ifndef HAVE_LIBZ
+		if (image_format_of(check_formats[i]) == IMAGE_PNG) {
+			printf("SKIP %10s %10s no zlib\n", "encode", name);
+			continue;
+		}
+#endif
+		snprintf(file, sizeof(file), "%s%s", base, check_formats[i]);
+		if (encode_img(img, file, opts->width, opts->height, opts->nb_thread) >= 0)
+			dec = decode_img(file, &width, &height);
+		unlink(file);
+		if (dec != NULL && width == opts->width && height == opts->height &&
+				memcmp(dec, ppm != NULL ? ppm : img, len) == 0) {
+			printf("PASS %10s %10s\n", "encode", name);
+		} else {
+			ret = -1;
+			printf("FAIL %10s %10s\n", "encode", name);
+		}
+		if (ppm == NULL)
+			ppm = dec;
+		else
+			FREE(dec);
+	}
+	unlink(base);
+	FREE(ppm);
+	return ret;
+}
+
 static int check_draw(struct command_opts *opts)
 {
 	int ret = 0;
 	int i;
 	limits_t limits;
-	int area;
+	uint64_t area;
 	int dragon_width;
 	int dragon_height;
 	int threshold;
@@ -278,7 +643,7 @@ static int check_draw(struct command_opts *opts)
 
 	dragon_width = limits.maximums.x - limits.minimums.x;
 	dragon_height = limits.maximums.y - limits.minimums.y;
-	area = dragon_width * dragon_height;
+	area = (uint64_t) dragon_width * dragon_height;
 	threshold = opts->nb_thread * 2;
 
 	img_exp = make_canvas(opts->width, opts->height);
@@ -299,8 +664,16 @@ static int check_draw(struct command_opts *opts)
 			printf("Error executing draw with %s\n", name);
 			goto err;
 		}
-		int gap = cmp_canvas(drg_exp, drg_act, dragon_width, dragon_height, opts->verbose);
-		float gap_f = gap * 100 / ((float) area);
+		int gap;
+		float gap_f;
+		if (drg_act == NULL) {
+			/* streaming libs have no canvas, compare the images */
+			gap = cmp_image(img_exp, img_act, opts->width, opts->height, opts->verbose);
+			gap_f = gap * 100 / ((float) opts->width * opts->height);
+		} else {
+			gap = cmp_canvas(drg_exp, drg_act, dragon_width, dragon_height, opts->verbose);
+			gap_f = gap * 100 / ((float) area);
+		}
 		if (gap < threshold && gap >= 0) {
 			printf(fmt, "PASS", "draw", name, threshold, gap, gap_f);
 		} else {
@@ -319,14 +692,19 @@ static int check_draw(struct command_opts *opts)
 			FREE(f1);
 			FREE(f2);
 		}
-		FREE(drg_act);
+		canvas_release(drg_act);
+		drg_act = NULL;
 	}
+	if (check_sweep(opts, img_exp, img_act, threshold) < 0)
+		ret = -1;
+	if (check_encode(opts, img_exp) < 0)
+		ret = -1;
 
 done:
 	FREE(img_exp);
 	FREE(img_act);
-	FREE(drg_exp);
-	FREE(drg_act);
+	canvas_release(drg_exp);
+	canvas_release(drg_act);
 	FREE(f1);
 	FREE(f2);
 	return ret;
@@ -348,6 +726,551 @@ static int cmd_check(struct command_opts *opts)
 static const struct command_def cmd_check_def =
 { .name = "check", .handler = cmd_check };
 
+struct bench_result {
+	const char *cmd;
+	const char *lib;
+	uint64_t size;
+	int nb_thread;
+	struct metrics_summary time;
+	double speedup;
+	double efficiency;
+};
+
+/*
+ * The libs print their timings, which would flood the results of the bench:
+ * send stdout to /dev/null while they run.
+ */
+static int quiet_begin(void)
+{
+	int fd, null;
+
+	fflush(stdout);
+	if ((fd = dup(STDOUT_FILENO)) < 0)
+		return -1;
+	if ((null = open("/dev/null", O_WRONLY)) < 0) {
+		close(fd);
+		return -1;
+	}
+	dup2(null, STDOUT_FILENO);
+	close(null);
+	return fd;
+}
+
+static void quiet_end(int fd)
+{
+	if (fd < 0)
+		return;
+	fflush(stdout);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+/* time warmup + repeat runs of a lib, samples holds the repeat measures */
+static int bench_run(struct command_opts *opts, const char *cmd, const struct lib_def *lib,
+		uint64_t size, int nb_thread, struct rgb *img, double *samples)
+{
+	char *dragon = NULL;
+	limits_t limits;
+	double begin;
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < opts->warmup + opts->repeat && ret == 0; i++) {
+		begin = metrics_now();
+		if (strcmp(cmd, "draw") == 0) {
+			ret = lib->draw_handler(&dragon, img, opts->width, opts->height, size, nb_thread);
+			canvas_release(dragon);
+			dragon = NULL;
+		} else {
+			ret = lib->limits_handler(&limits, size, nb_thread);
+		}
+		if (i >= opts->warmup)
+			samples[i - opts->warmup] = metrics_now() - begin;
+	}
+	return ret;
+}
+
+static void bench_report(struct command_opts *opts, struct bench_result *res)
+{
+	if (opts->stats == METRICS_JSON) {
+		printf("{\"cmd\":\"%s\",\"lib\":\"%s\",\"size\":%" PRIu64 ",\"thread\":%d,"
+				"\"runs\":%d,\"median_ms\":%.3f,\"min_ms\":%.3f,\"stddev_ms\":%.3f,"
+				"\"speedup\":%.3f,\"efficiency\":%.3f}\n",
+				res->cmd, res->lib, res->size, res->nb_thread, opts->repeat,
+				res->time.median, res->time.min, res->time.stddev,
+				res->speedup, res->efficiency);
+	} else {
+		printf("%s,%s,%" PRIu64 ",%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+				res->cmd, res->lib, res->size, res->nb_thread, opts->repeat,
+				res->time.median, res->time.min, res->time.stddev,
+				res->speedup, res->efficiency);
+	}
+}
+
+/*
+ * Sweep the commands, powers, thread counts and libs in this process.
+ * Speedup and efficiency are relative to the median of the serial lib at
+ * the same size. Canvas and image buffers are reused between runs.
+ */
+static int cmd_bench(struct command_opts *opts)
+{
+	static const char *cmds[] = { "draw", "limits", NULL };
+	const struct lib_def *serial = &libs[0];
+	struct bench_result *results = NULL;
+	double *samples = NULL;
+	struct rgb *img = NULL;
+	int power = opts->power;
+	int power_max = power > 0 && opts->power_max > 0 ? opts->power_max : power;
+	int nb_result = 0;
+	int ret = 0;
+	int c, p, t, i;
+
+	if ((img = make_canvas(opts->width, opts->height)) == NULL)
+		goto err;
+	if ((samples = calloc(opts->repeat, sizeof(double))) == NULL)
+		goto err;
+	/* power 0 means a single run at --size */
+	i = 2 * (power_max - power + 1) * (opts->nb_thread * (sizeof(libs) / sizeof(libs[0])) + 1);
+	if ((results = calloc(i, sizeof(struct bench_result))) == NULL)
+		goto err;
+
+	canvas_reuse(1);
+	for (c = 0; cmds[c] != NULL; c++) {
+		for (p = power; p <= power_max; p++) {
+			uint64_t size = power > 0 ? 1LL << p : opts->size;
+			struct bench_result *base = &results[nb_result];
+			int fd;
+
+			fprintf(stderr, "bench %s serial size=%" PRIu64 "\n", cmds[c], size);
+			fd = quiet_begin();
+			ret = bench_run(opts, cmds[c], serial, size, 1, img, samples);
+			quiet_end(fd);
+			if (ret < 0) {
+				printf("Error executing %s with serial\n", cmds[c]);
+				goto err;
+			}
+			base->cmd = cmds[c];
+			base->lib = serial->name;
+			base->size = size;
+			base->nb_thread = 1;
+			metrics_summarize(samples, opts->repeat, &base->time);
+			base->speedup = 1;
+			base->efficiency = 1;
+			nb_result++;
+
+			for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+				const struct lib_def *lib = &libs[i];
+				if (lib == serial || (!opts->all_libs && lib != opts->lib))
+					continue;
+				for (t = 1; t <= opts->nb_thread; t++) {
+					struct bench_result *res = &results[nb_result];
+					fprintf(stderr, "bench %s %s size=%" PRIu64 " thread=%d\n",
+							cmds[c], lib->name, size, t);
+					fd = quiet_begin();
+					ret = bench_run(opts, cmds[c], lib, size, t, img, samples);
+					quiet_end(fd);
+					if (ret < 0) {
+						printf("Error executing %s with %s\n", cmds[c], lib->name);
+						goto err;
+					}
+					res->cmd = cmds[c];
+					res->lib = lib->name;
+					res->size = size;
+					res->nb_thread = t;
+					metrics_summarize(samples, opts->repeat, &res->time);
+					res->speedup = base->time.median / res->time.median;
+					res->efficiency = res->speedup / t;
+					nb_result++;
+				}
+			}
+		}
+	}
+
+	if (opts->stats != METRICS_JSON)
+		printf("cmd,lib,size,thread,runs,median_ms,min_ms,stddev_ms,speedup,efficiency\n");
+	for (i = 0; i < nb_result; i++)
+		bench_report(opts, &results[i]);
+
+done:
+	canvas_reuse(0);
+	FREE(results);
+	FREE(samples);
+	FREE(img);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_bench_def =
+{ .name = "bench", .handler = cmd_bench };
+
+/*
+ * Performance regression gate
+ *
+ * perfcheck runs the draw of each lib for the perf_threads x perf_powers
+ * matrix and compares the run, draw and render times with a baseline file.
+ * A time regresses when its median exceeds the baseline median by more than
+ * --tolerance percent plus twice the combined standard deviation, and its
+ * minimum exceeds the baseline minimum by more than --tolerance percent. A
+ * regression is measured again once before failing. The samples far from
+ * the median are left out of the statistics. The hash
+ * of the drawn cells must match the baseline, which replaces the comparison
+ * with the serial canvas of check. With --update, the baseline is written
+ * instead. The thread counts of the matrix are capped to the cpus of the
+ * machine writing the baseline, a row with more threads would only measure
+ * oversubscription; checking runs the thread counts of the baseline, and only
+ * compares the hashes of those above the cpus of the machine.
+ */
+enum perf_metric {
+	PERF_TOTAL,
+	PERF_DRAW,
+	PERF_RENDER,
+	PERF_METRIC_COUNT,
+};
+
+static const char *perf_metric_names[PERF_METRIC_COUNT] = { "total", "draw", "render" };
+
+struct perf_result {
+	char lib[32];
+	int nb_thread;
+	int power;
+	struct metrics_summary time[PERF_METRIC_COUNT];
+	uint64_t hash;
+	int seen;
+};
+
+struct perf_baseline {
+	char cpu[128];
+	int nproc;
+	struct perf_result *results;
+	int nb_result;
+};
+
+static const int perf_threads[] = { 1, 4 };
+static const int perf_powers[] = { 18, 22 };
+
+#define PERF_NB_THREADS	((int) (sizeof(perf_threads) / sizeof(perf_threads[0])))
+#define PERF_NB_POWERS	((int) (sizeof(perf_powers) / sizeof(perf_powers[0])))
+/* thread counts read from a baseline */
+#define PERF_MAX_THREADS	8
+
+/* model name of the first cpu, the baseline timings are only valid on it */
+static void perf_cpu(char *cpu, size_t len)
+{
+	char line[256];
+	FILE *f;
+
+	snprintf(cpu, len, "unknown");
+	if ((f = fopen("/proc/cpuinfo", "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *value = strchr(line, ':');
+		if (strncmp(line, "model name", strlen("model name")) != 0 || value == NULL)
+			continue;
+		value += strspn(value, ": \t");
+		value[strcspn(value, "\n")] = '\0';
+		snprintf(cpu, len, "%s", value);
+		break;
+	}
+	fclose(f);
+}
+
+static int perf_baseline_read(const char *path, struct perf_baseline *base)
+{
+	struct perf_result *res;
+	char line[512];
+	int version = -1;
+	int ret = 0;
+	FILE *f;
+
+	memset(base, 0, sizeof(struct perf_baseline));
+	if ((f = fopen(path, "r")) == NULL) {
+		printf("Error: cannot open baseline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		if (sscanf(line, "version %d", &version) == 1)
+			continue;
+		if (sscanf(line, "cpu %127[^\n]", base->cpu) == 1)
+			continue;
+		if (sscanf(line, "nproc %d", &base->nproc) == 1)
+			continue;
+		res = realloc(base->results, (base->nb_result + 1) * sizeof(struct perf_result));
+		if (res == NULL)
+			goto err;
+		base->results = res;
+		res = &res[base->nb_result];
+		memset(res, 0, sizeof(struct perf_result));
+		if (sscanf(line, "%31s %d %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %" SCNx64, res->lib,
+				&res->nb_thread, &res->power,
+				&res->time[PERF_TOTAL].median, &res->time[PERF_TOTAL].stddev,
+				&res->time[PERF_TOTAL].min,
+				&res->time[PERF_DRAW].median, &res->time[PERF_DRAW].stddev,
+				&res->time[PERF_DRAW].min,
+				&res->time[PERF_RENDER].median, &res->time[PERF_RENDER].stddev,
+				&res->time[PERF_RENDER].min, &res->hash) != 13) {
+			printf("Error: bad baseline line: %s\n", line);
+			goto err;
+		}
+		base->nb_result++;
+	}
+	if (version != PERF_BASELINE_VERSION) {
+		printf("Error: baseline version %d, expected %d\n", version, PERF_BASELINE_VERSION);
+		goto err;
+	}
+done:
+	fclose(f);
+	return ret;
+err:
+	FREE(base->results);
+	ret = -1;
+	goto done;
+}
+
+static int perf_baseline_write(const char *path, struct perf_result *results, int nb_result)
+{
+	char cpu[128];
+	FILE *f;
+	int i, m;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		printf("Error: cannot write baseline %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	perf_cpu(cpu, sizeof(cpu));
+	fprintf(f, "# dragonizer perfcheck baseline, written by make perfcheck-update\n");
+	fprintf(f, "version %d\n", PERF_BASELINE_VERSION);
+	fprintf(f, "cpu %s\n", cpu);
+	fprintf(f, "nproc %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(f, "# lib thread power, median stddev min of total draw render in ms, hash\n");
+	for (i = 0; i < nb_result; i++) {
+		struct perf_result *res = &results[i];
+		fprintf(f, "%s %d %d", res->lib, res->nb_thread, res->power);
+		for (m = 0; m < PERF_METRIC_COUNT; m++)
+			fprintf(f, " %.3f %.3f %.3f", res->time[m].median, res->time[m].stddev,
+					res->time[m].min);
+		fprintf(f, " %016" PRIx64 "\n", res->hash);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* time warmup + repeat draws, samples holds PERF_METRIC_COUNT * repeat measures */
+static int perf_run(struct command_opts *opts, const struct lib_def *lib, struct perf_result *res,
+		struct rgb *img, double *samples)
+{
+	uint64_t size = 1LL << res->power;
+	char *dragon = NULL;
+	limits_t limits;
+	double begin;
+	int ret = 0;
+	int i, m;
+	int fd;
+
+	fd = quiet_begin();
+	for (i = 0; i < opts->warmup + opts->repeat && ret == 0; i++) {
+		metrics_reset();
+		begin = metrics_now();
+		ret = lib->draw_handler(&dragon, img, opts->width, opts->height, size, res->nb_thread);
+		if (ret == 0 && i >= opts->warmup) {
+			samples[PERF_TOTAL * opts->repeat + i - opts->warmup] = metrics_now() - begin;
+			samples[PERF_DRAW * opts->repeat + i - opts->warmup] = metrics_phase_ms(METRICS_DRAW);
+			samples[PERF_RENDER * opts->repeat + i - opts->warmup] = metrics_phase_ms(METRICS_RENDER);
+		}
+		if (ret == 0 && i == opts->warmup + opts->repeat - 1) {
+			if (dragon == NULL) {
+				/* streaming libs have no canvas */
+				res->hash = image_hash(img, opts->width, opts->height);
+			} else {
+				ret = dragon_limits_table(&limits, size, 1);
+				res->hash = canvas_hash(dragon, limits.maximums.x - limits.minimums.x,
+						limits.maximums.y - limits.minimums.y);
+			}
+		}
+		canvas_release(dragon);
+		dragon = NULL;
+	}
+	quiet_end(fd);
+	for (m = 0; m < PERF_METRIC_COUNT; m++) {
+		double *s = &samples[m * opts->repeat];
+		metrics_summarize(s, metrics_reject_outliers(s, opts->repeat), &res->time[m]);
+	}
+	return ret;
+}
+
+/* metrics of act over the tolerance, as a bit mask of enum perf_metric */
+static int perf_regressions(struct command_opts *opts, struct perf_result *exp,
+		struct perf_result *act)
+{
+	int mask = 0;
+	int m;
+
+	for (m = 0; m < PERF_METRIC_COUNT; m++) {
+		struct metrics_summary *e = &exp->time[m];
+		struct metrics_summary *a = &act->time[m];
+		double tolerance = 1 + opts->tolerance / 100;
+		double limit = e->median * tolerance +
+				2 * sqrt(e->stddev * e->stddev + a->stddev * a->stddev);
+		/* too short to be timed reliably */
+		if (e->median < PERF_MIN_MS)
+			continue;
+		/* other processes slow some runs, a regression slows the fastest too */
+		if (a->median > limit && a->min > e->min * tolerance)
+			mask |= 1 << m;
+	}
+	return mask;
+}
+
+static void perf_print(const char *status, struct perf_result *exp, struct perf_result *act,
+		int regressions)
+{
+	int m;
+
+	printf("%-4s %10s thread=%d power=%d", status, act->lib, act->nb_thread, act->power);
+	for (m = 0; m < PERF_METRIC_COUNT; m++) {
+		printf(" %s %.3f", perf_metric_names[m], act->time[m].median);
+		if (exp != NULL && exp->time[m].median > 0)
+			printf(" (%+.1f%%%s)", 100 * (act->time[m].median / exp->time[m].median - 1),
+					regressions & (1 << m) ? " slower" : "");
+	}
+	if (exp != NULL && exp->hash != act->hash)
+		printf(" hash %016" PRIx64 " expected %016" PRIx64, act->hash, exp->hash);
+	printf("\n");
+}
+
+/* distinct thread counts of the matrix, the perf_threads capped to nproc on update */
+static int perf_thread_counts(struct command_opts *opts, struct perf_baseline *base,
+		long nproc, int *threads)
+{
+	int count = opts->update ? PERF_NB_THREADS : base->nb_result;
+	int nb = 0;
+	int i, k, n;
+
+	for (i = 0; i < count && nb < PERF_MAX_THREADS; i++) {
+		if (opts->update)
+			n = perf_threads[i] < nproc ? perf_threads[i] : nproc;
+		else
+			n = base->results[i].nb_thread;
+		for (k = 0; k < nb && threads[k] != n; k++)
+			;
+		if (k == nb)
+			threads[nb++] = n;
+	}
+	return nb;
+}
+
+static int cmd_perfcheck(struct command_opts *opts)
+{
+	struct perf_baseline base;
+	struct perf_result *results = NULL;
+	double *samples = NULL;
+	struct rgb *img = NULL;
+	char cpu[128];
+	int nb_result = 0;
+	int timings = 1;
+	int ret = 0;
+	int threads[PERF_MAX_THREADS];
+	int nb_threads;
+	int i, t, p, k;
+	long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+
+	memset(&base, 0, sizeof(struct perf_baseline));
+	if (!opts->update && perf_baseline_read(opts->baseline, &base) < 0)
+		goto err;
+	if ((img = make_canvas(opts->width, opts->height)) == NULL)
+		goto err;
+	if ((samples = calloc(PERF_METRIC_COUNT * opts->repeat, sizeof(double))) == NULL)
+		goto err;
+	nb_threads = perf_thread_counts(opts, &base, nproc, threads);
+	i = nb_threads * PERF_NB_POWERS * (sizeof(libs) / sizeof(libs[0]));
+	if ((results = calloc(i, sizeof(struct perf_result))) == NULL)
+		goto err;
+
+	perf_cpu(cpu, sizeof(cpu));
+	if (!opts->update && (strcmp(cpu, base.cpu) != 0 ||
+			base.nproc != nproc)) {
+		printf("warning: baseline of another machine (%s, %d cpus), only hashes are compared\n",
+				base.cpu, base.nproc);
+		timings = 0;
+	}
+
+	canvas_reuse(1);
+	for (i = 0; libs[i].lib != THREAD_LIB_NONE; i++) {
+		const struct lib_def *lib = &libs[i];
+		if (!opts->update && !opts->all_libs && lib != opts->lib)
+			continue;
+		for (t = 0; t < nb_threads; t++) {
+			for (p = 0; p < PERF_NB_POWERS; p++) {
+				struct perf_result *res = &results[nb_result++];
+				struct perf_result *exp = NULL;
+				int regressions;
+
+				snprintf(res->lib, sizeof(res->lib), "%s", lib->name);
+				res->nb_thread = threads[t];
+				res->power = perf_powers[p];
+				if (perf_run(opts, lib, res, img, samples) < 0) {
+					printf("Error executing draw with %s\n", lib->name);
+					goto err;
+				}
+				if (opts->update) {
+					perf_print("RUN", NULL, res, 0);
+					continue;
+				}
+				for (k = 0; k < base.nb_result; k++) {
+					struct perf_result *b = &base.results[k];
+					if (strcmp(b->lib, res->lib) == 0 && b->nb_thread == res->nb_thread &&
+							b->power == res->power)
+						exp = b;
+				}
+				if (exp == NULL) {
+					perf_print("NEW", NULL, res, 0);
+					continue;
+				}
+				exp->seen = 1;
+				regressions = timings && res->nb_thread <= nproc ?
+						perf_regressions(opts, exp, res) : 0;
+				if (regressions) {
+					/* confirm, a regression may be noise of the machine */
+					if (perf_run(opts, lib, res, img, samples) < 0)
+						goto err;
+					regressions = perf_regressions(opts, exp, res);
+				}
+				if (regressions || exp->hash != res->hash) {
+					perf_print("FAIL", exp, res, regressions);
+					ret = -1;
+				} else {
+					perf_print("PASS", exp, res, 0);
+				}
+			}
+		}
+	}
+	for (k = 0; k < base.nb_result && opts->all_libs; k++) {
+		if (!base.results[k].seen)
+			printf("SKIP %10s thread=%d power=%d not run\n", base.results[k].lib,
+					base.results[k].nb_thread, base.results[k].power);
+	}
+	if (opts->update && perf_baseline_write(opts->baseline, results, nb_result) < 0)
+		goto err;
+
+done:
+	canvas_reuse(0);
+	FREE(base.results);
+	FREE(results);
+	FREE(samples);
+	FREE(img);
+	return ret;
+err:
+	ret = -1;
+	goto done;
+}
+
+static const struct command_def cmd_perfcheck_def =
+{ .name = "perfcheck", .handler = cmd_perfcheck };
+
 static const struct command_def cmd_def_last =
 { .name = NULL, .handler = NULL };
 
@@ -355,6 +1278,8 @@ static const struct command_def const *commands[] = {
 		&cmd_draw_def,
 		&cmd_limit_def,
 		&cmd_check_def,
+		&cmd_bench_def,
+		&cmd_perfcheck_def,
 		&cmd_def_last
 };
 
@@ -384,12 +1309,46 @@ static void dump_opts(struct command_opts *opts)
 	printf("%10s %s\n", "cmd", opts->cmd->name);
 	printf("%10s %s\n", "lib", opts->lib->name);
 	printf("%10s %s\n", "output", opts->pgm_path);
+	printf("%10s %d\n", "mmap", opts->mmap);
+	printf("%10s %d\n", "increment", opts->incremental);
+	printf("%10s %d\n", "frames", opts->frames);
+	printf("%10s %d\n", "buffers", opts->write_buffers);
 	printf("%10s %d\n", "thread", opts->nb_thread);
 	printf("%10s %d\n", "height", opts->height);
 	printf("%10s %d\n", "width", opts->width);
 	printf("%10s %" PRId64 "\n", "size", opts->size);
 	printf("%10s %d\n", "power", opts->power);
 	printf("%10s %d\n", "max", opts->power_max);
+	printf("%10s %s\n", "layout", canvas_layout_name(canvas_layout));
+	printf("%10s %s\n", "packing", canvas_packed ? "nibble" : "byte");
+	printf("%10s %" PRIu64 "\n", "canvas", canvas_memory >> 20);
+	printf("%10s %s\n", "canvasdir", canvas_dir);
+	printf("%10s %d\n", "repeat", opts->repeat);
+	printf("%10s %d\n", "warmup", opts->warmup);
+	printf("%10s %s\n", "baseline", opts->baseline);
+	printf("%10s %.1f\n", "tolerance", opts->tolerance);
+}
+
+/* canvas area of the largest dragon of the run, in the current layout */
+static uint64_t dragon_area(struct command_opts *opts)
+{
+	uint64_t size = opts->power > 0 && opts->power_max > 0 ? 1ULL << opts->power_max : opts->size;
+	int64_t width, height;
+	piece_t piece;
+
+	piece_init(&piece);
+	piece_range(0, size, &piece);
+	width = piece.limits.maximums.x - piece.limits.minimums.x;
+	height = piece.limits.maximums.y - piece.limits.minimums.y;
+	/* only the viewport is allocated */
+	if (opts->viewport_set) {
+		limits_t clip = opts->viewport;
+		if (viewport_clip(&clip, width, height) < 0)
+			return 0;
+		width = clip.maximums.x - clip.minimums.x;
+		height = clip.maximums.y - clip.minimums.y;
+	}
+	return canvas_area(width, height);
 }
 
 void default_int_value(int *val, int def)
@@ -416,12 +1375,34 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 			{ "power",	 1, 0, 'p' },
 			{ "max",	 1, 0, 'm' },
 			{ "verbose", 0, 0, 'v' },
+			{ "layout",	 1, 0, 'L' },
+			{ "packing", 1, 0, 'A' },
+			{ "schedule", 1, 0, 'S' },
+			{ "pthread-schedule", 1, 0, 'P' },
+			{ "mpi-draw", 1, 0, 'N' },
+			{ "stats",	 1, 0, 'T' },
+			{ "repeat",	 1, 0, 'r' },
+			{ "warmup",	 1, 0, 'w' },
+			{ "perf-counters", 0, 0, 'C' },
+			{ "baseline", 1, 0, 'B' },
+			{ "tolerance", 1, 0, 'X' },
+			{ "update",	 0, 0, 'u' },
+			{ "mmap",	 0, 0, 'M' },
+			{ "canvas-memory", 1, 0, 'K' },
+			{ "canvas-dir", 1, 0, 'D' },
+			{ "incremental", 0, 0, 'I' },
+			{ "frames",	 0, 0, 'F' },
+			{ "write-buffers", 1, 0, 'W' },
+			{ "viewport", 1, 0, 'V' },
 			{ 0, 0, 0, 0}
 	};
 
 	memset(opts, 0, sizeof(struct command_opts));
+	opts->warmup = -1;
+	opts->tolerance = -1;
+	opts->write_buffers = -1;
 
-	while ((opt = getopt_long(argc, argv, "hvx:y:s:c:t:l:p:o:m:", options, &idx)) != -1) {
+	while ((opt = getopt_long(argc, argv, "hvCuMIFx:y:s:c:t:l:p:o:m:L:A:S:P:T:r:w:B:X:K:D:W:N:V:", options, &idx)) != -1) {
 		switch(opt) {
 		case 'c':
 			opts->cmd = lookup_cmd(optarg);
@@ -447,7 +1428,7 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 			opts->width = atoi(optarg);
 			break;
 		case 's':
-			opts->size = atoi(optarg);
+			opts->size = strtoull(optarg, NULL, 10);
 			break;
 		case 'p':
 			opts->power = atoi(optarg);
@@ -461,6 +1442,104 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		case 'v':
 			opts->verbose = 1;
 			break;
+		case 'L':
+			if (strcmp(optarg, "linear") == 0) {
+				canvas_layout = CANVAS_LINEAR;
+			} else if (strcmp(optarg, "tiled") == 0) {
+				canvas_layout = CANVAS_TILED;
+			} else {
+				printf("unknown canvas layout %s\n", optarg);
+				ret = -1;
+			}
+			opts->layout_set = 1;
+			break;
+		case 'A':
+			if (strcmp(optarg, "auto") == 0) {
+				opts->packing = PACKING_AUTO;
+			} else if (strcmp(optarg, "byte") == 0) {
+				opts->packing = PACKING_BYTE;
+			} else if (strcmp(optarg, "nibble") == 0) {
+				opts->packing = PACKING_NIBBLE;
+			} else {
+				printf("unknown canvas packing %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'K':
+			canvas_memory = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'D':
+			canvas_dir = optarg;
+			break;
+		case 'S':
+			if (dragon_openmp_schedule(optarg) < 0) {
+				printf("unknown openmp schedule %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'P':
+			if (dragon_pthread_schedule(optarg) < 0) {
+				printf("unknown pthread schedule %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'N':
+			if (dragon_mpi_draw_mode(optarg) < 0) {
+				printf("unknown mpi draw mode %s\n", optarg);
+				ret = -1;
+			}
+			break;
+		case 'r':
+			opts->repeat = atoi(optarg);
+			break;
+		case 'w':
+			opts->warmup = atoi(optarg);
+			break;
+		case 'B':
+			if (asprintf(&opts->baseline, "%s", optarg) < 0)
+				goto err;
+			break;
+		case 'X':
+			opts->tolerance = atof(optarg);
+			break;
+		case 'u':
+			opts->update = 1;
+			break;
+		case 'M':
+			opts->mmap = 1;
+			break;
+		case 'I':
+			opts->incremental = 1;
+			break;
+		case 'F':
+			opts->frames = 1;
+			break;
+		case 'W':
+			opts->write_buffers = atoi(optarg);
+			break;
+		case 'V':
+			if (sscanf(optarg, "%"SCNd64",%"SCNd64",%"SCNd64",%"SCNd64,
+					&opts->viewport.minimums.x, &opts->viewport.minimums.y,
+					&opts->viewport.maximums.x, &opts->viewport.maximums.y) != 4 ||
+					opts->viewport.minimums.x < 0 || opts->viewport.minimums.y < 0 ||
+					opts->viewport.minimums.x >= opts->viewport.maximums.x ||
+					opts->viewport.minimums.y >= opts->viewport.maximums.y) {
+				printf("invalid viewport %s, expected x0,y0,x1,y1\n", optarg);
+				ret = -1;
+			}
+			opts->viewport_set = 1;
+			break;
+		case 'C':
+			/* not an error, the run goes on without the counters */
+			if (perfctr_enable() < 0)
+				printf("perf counters disabled\n");
+			break;
+		case 'T':
+			if (metrics_format_parse(optarg, &opts->stats) < 0) {
+				printf("unknown stats format %s\n", optarg);
+				ret = -1;
+			}
+			break;
 		default:
 			printf("unknown option %c\n", opt);
 			ret = -1;
@@ -469,22 +1548,32 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 	}
 
 	/* default values*/
-	if (opts->lib == NULL)
+	if (opts->lib == NULL) {
 		opts->lib = lookup_lib(DEFAULT_LIB_NAME);
+		opts->all_libs = 1;
+	}
+	if (opts->warmup < 0)
+		opts->warmup = BENCH_WARMUP;
+	if (opts->tolerance < 0)
+		opts->tolerance = PERF_TOLERANCE;
+	if (opts->write_buffers < 0)
+		opts->write_buffers = WRITE_BUFFERS;
+	if (opts->baseline == NULL)
+		opts->baseline = DEFAULT_BASELINE;
 
 	if (opts->pgm_path == NULL)
 		opts->pgm_path = DEFAULT_IMG_PATH;
 
-	if (opts->size > (1LL << POWER_MAX)) {
-		printf("Error: size must be lower or equals to %"PRId64"\n", opts->size);
+	if (opts->size > (UINT64_C(1) << POWER_MAX)) {
+		printf("Error: size must be lower or equals to %"PRIu64"\n", UINT64_C(1) << POWER_MAX);
 		ret = -1;
 	}
-	if ((opts->power < 0) || (opts->power >= POWER_MAX)) {
+	if ((opts->power < 0) || (opts->power > POWER_MAX)) {
 		printf("Error: power argument out of range [0,%d]\n", POWER_MAX);
 		ret = -1;
 	}
 
-	if (opts->power_max < 0 || opts->power >= POWER_MAX) {
+	if (opts->power_max < 0 || opts->power_max > POWER_MAX) {
 		printf("Error: max argument out of range [0,%d]\n", POWER_MAX);
 		ret = -1;
 	}
@@ -496,15 +1585,79 @@ static int parse_opts(int argc, char **argv, struct command_opts *opts)
 		}
 	}
 
+	if (opts->incremental || opts->frames) {
+		if (opts->power <= 0 || opts->power_max <= 0) {
+			printf("Error: --incremental and --frames require --power and --max\n");
+			ret = -1;
+		} else if (opts->incremental && opts->lib->sweep_handler == NULL) {
+			printf("Error: lib %s has no incremental sweep\n", opts->lib->name);
+			ret = -1;
+		}
+	}
+
+	if (opts->viewport_set && opts->incremental) {
+		printf("Error: --viewport does not support --incremental\n");
+		ret = -1;
+	}
+
+	/* the viewport has its own serial draw, the lib would be ignored */
+	if (opts->viewport_set && opts->lib->lib != THREAD_LIB_SERIAL) {
+		printf("Error: --viewport draws serially, it does not support --lib %s\n",
+				opts->lib->name);
+		ret = -1;
+	}
+
+	/* the ranks would all write the same file */
+	if (opts->lib->lib == THREAD_LIB_MPI && (opts->mmap || opts->frames)) {
+		printf("Error: lib mpi does not support --mmap and --frames\n");
+		ret = -1;
+	}
+
 	if (opts->power > 0)
 		opts->size = 1LL << opts->power;
 
 	if (opts->size ==  0)
 		opts->size = DEFAULT_SIZE;
 
+	default_int_value(&opts->nb_thread, DEFAULT_NB_THREAD);
+
+#ifndef HAVE_PARALLEL_STL
+	/* only the colors and the blocks follow --thread */
+	if (opts->lib->lib == THREAD_LIB_STL && opts->nb_thread > 1)
+		printf("warning: the C++ library runs std::execution::par serially (no TBB), "
+				"lib stl draws on 1 thread\n");
+#endif
+
+	/*
+	 * The colors are the threads, a nibble holds them and the empty cell. The
+	 * threads drawing a packed canvas update its bytes with atomics, so it is
+	 * only worth it when the bytes would go through the file of a mapped canvas.
+	 */
+	if (opts->packing == PACKING_NIBBLE && opts->nb_thread > CANVAS_PACKED_COLORS) {
+		printf("Error: a packed canvas holds up to %d threads\n", CANVAS_PACKED_COLORS);
+		ret = -1;
+	}
+	canvas_packed = opts->packing == PACKING_NIBBLE;
+	if (ret == 0 && opts->packing == PACKING_AUTO && opts->nb_thread <= CANVAS_PACKED_COLORS &&
+			canvas_mapped(dragon_area(opts))) {
+		canvas_packed = 1;
+		printf("The canvas does not fit in memory, packing two cells per byte\n");
+	}
+
+	/* a mapped canvas is tiled, a tile being a page of the file */
+	if (ret == 0 && !opts->layout_set && canvas_mapped(dragon_area(opts))) {
+		canvas_layout = CANVAS_TILED;
+		printf("The canvas does not fit in memory, using the tiled layout\n");
+	}
+
 	default_int_value(&opts->height, DEFAULT_HEIGHT);
 	default_int_value(&opts->width, DEFAULT_WIDTH);
-	default_int_value(&opts->nb_thread, DEFAULT_NB_THREAD);
+	default_int_value(&opts->repeat, BENCH_REPEAT);
+
+	if (opts->repeat < 0 || opts->warmup < 0) {
+		fprintf(stderr, "argument error: repeat and warmup must be positive\n");
+		ret = -1;
+	}
 
 	if (opts->width == 0 || opts->height == 0) {
 		fprintf(stderr, "argument error: height and width must be greater than 0\n");
@@ -534,6 +1687,14 @@ int main(int argc, char **argv)
 		usage();
 	}
 
+	/* every rank of mpirun runs the command, the first one reports */
+	if (opts.lib->lib == THREAD_LIB_MPI) {
+		if (dragon_mpi_init() < 0)
+			goto err;
+		if (!dragon_mpi_root() && freopen("/dev/null", "w", stdout) == NULL)
+			goto err;
+	}
+
 	if ((opts.cmd->handler(&opts)) < 0) {
 		printf("Error while executing command %s\n", opts.cmd->name);
 		goto err;
@@ -0,0 +1,643 @@
+/*
+ * encode.c
+ *
+ * The image is split in stripes of rows, encoded by the workers of the
+ * pthread pool, then written in order.
+ *
+ * QOI: a stripe starts with the last pixel of the previous stripe as
+ * previous pixel and an empty index. Its index only holds pixels of the
+ * stripe, which the decoder also holds at the same positions, so the
+ * stripes concatenated are a valid stream.
+ *
+ * PNG: each stripe is filtered and deflated alone as raw deflate data. All
+ * but the last end with a sync flush, byte aligned and not final, so that
+ * the zlib header, the stripes and the combined adler32 make one zlib
+ * stream. Each stripe is an IDAT chunk.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "dragon.h"
+#include "encode.h"
+#include "pool.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+/* stripes per thread, for balance */
+#define ENCODE_STRIPES	4
+#define PNG_LEVEL		6
+
+#define QOI_OP_INDEX	0x00
+#define QOI_OP_DIFF		0x40
+#define QOI_OP_LUMA		0x80
+#define QOI_OP_RUN		0xc0
+#define QOI_OP_RGB		0xfe
+#define QOI_RUN_MAX		62
+#define QOI_HASH(px)	(((px).r * 3 + (px).g * 5 + (px).b * 7 + 255 * 11) % 64)
+
+struct stripe {
+	int first;
+	int last;
+	unsigned char *buf;
+	size_t len;
+	/* png: adler32 and length of the filtered rows */
+	unsigned long check;
+	size_t raw;
+	unsigned long crc;
+	int err;
+};
+
+struct encode_job {
+	enum image_format format;
+	struct rgb *image;
+	int width;
+	int height;
+	int nb_stripe;
+	uint64_t next;
+	struct stripe *stripes;
+};
+
+enum image_format image_format_of(const char *file)
+{
+	const char *ext = file != NULL ? strrchr(file, '.') : NULL;
+
+	if (ext == NULL)
+		return IMAGE_PPM;
+	if (strcasecmp(ext, ".qoi") == 0)
+		return IMAGE_QOI;
+	if (strcasecmp(ext, ".png") == 0)
+		return IMAGE_PNG;
+	return IMAGE_PPM;
+}
+
+const char *image_format_name(enum image_format format)
+{
+	switch (format) {
+	case IMAGE_QOI:
+		return "qoi";
+	case IMAGE_PNG:
+		return "png";
+	case IMAGE_PPM:
+	default:
+		return "ppm";
+	}
+}
+
+static inline int rgb_equal(struct rgb a, struct rgb b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+static void qoi_stripe(struct encode_job *job, struct stripe *s)
+{
+	struct rgb index[64];
+	int valid[64];
+	struct rgb prev = { 0, 0, 0 };
+	uint64_t start = (uint64_t) s->first * job->width;
+	uint64_t end = (uint64_t) s->last * job->width;
+	unsigned char *out;
+	uint64_t p;
+	int run = 0;
+
+	memset(valid, 0, sizeof(valid));
+	if (start > 0)
+		prev = job->image[start - 1];
+	/* an RGB op of 4 bytes per pixel at most */
+	if ((s->buf = malloc((end - start) * 4)) == NULL) {
+		s->err = 1;
+		return;
+	}
+	out = s->buf;
+	for (p = start; p < end; p++) {
+		struct rgb px = job->image[p];
+		int h;
+
+		if (rgb_equal(px, prev)) {
+			if (++run == QOI_RUN_MAX) {
+				*out++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			*out++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+		h = QOI_HASH(px);
+		if (valid[h] && rgb_equal(index[h], px)) {
+			*out++ = QOI_OP_INDEX | h;
+		} else {
+			signed char vr = px.r - prev.r;
+			signed char vg = px.g - prev.g;
+			signed char vb = px.b - prev.b;
+			signed char vg_r = vr - vg;
+			signed char vg_b = vb - vg;
+
+			index[h] = px;
+			valid[h] = 1;
+			if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+				*out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+			} else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+				*out++ = QOI_OP_LUMA | (vg + 32);
+				*out++ = (vg_r + 8) << 4 | (vg_b + 8);
+			} else {
+				*out++ = QOI_OP_RGB;
+				*out++ = px.r;
+				*out++ = px.g;
+				*out++ = px.b;
+			}
+		}
+		prev = px;
+	}
+	if (run > 0)
+		*out++ = QOI_OP_RUN | (run - 1);
+	s->len = out - s->buf;
+}
+
+#ifdef HAVE_LIBZ
+
+static unsigned long png_crc(const char *type, const unsigned char *data, size_t len)
+{
+	unsigned long crc = crc32(0L, (const Bytef *) type, 4);
+	/* crc32 of a NULL buffer is the initial value, not crc */
+	return len > 0 ? crc32(crc, data, len) : crc;
+}
+
+static void png_stripe(struct encode_job *job, struct stripe *s)
+{
+	size_t row = 1 + sizeof(struct rgb) * job->width;
+	unsigned char *filtered = NULL;
+	unsigned long bound;
+	z_stream z;
+	int last = s->last == job->height;
+	int y, x;
+
+	s->raw = row * (s->last - s->first);
+	if ((filtered = malloc(s->raw)) == NULL)
+		goto err;
+	/* filter Up, the row above is read from the image */
+	for (y = s->first; y < s->last; y++) {
+		unsigned char *dst = &filtered[(y - s->first) * row];
+		unsigned char *cur = (unsigned char *) &job->image[(uint64_t) y * job->width];
+		unsigned char *up = y > 0 ? cur - sizeof(struct rgb) * job->width : NULL;
+		dst[0] = 2;
+		for (x = 0; x < (int) (row - 1); x++)
+			dst[x + 1] = cur[x] - (up != NULL ? up[x] : 0);
+	}
+	s->check = adler32(adler32(0L, Z_NULL, 0), filtered, s->raw);
+
+	memset(&z, 0, sizeof(z));
+	if (deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		goto err;
+	/* room for the empty block of the sync flush */
+	bound = deflateBound(&z, s->raw) + 16;
+	if ((s->buf = malloc(bound)) == NULL) {
+		deflateEnd(&z);
+		goto err;
+	}
+	z.next_in = filtered;
+	z.avail_in = s->raw;
+	z.next_out = s->buf;
+	z.avail_out = bound;
+	if (deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR || z.avail_in != 0) {
+		deflateEnd(&z);
+		goto err;
+	}
+	s->len = bound - z.avail_out;
+	deflateEnd(&z);
+	s->crc = png_crc("IDAT", s->buf, s->len);
+	FREE(filtered);
+	return;
+err:
+	FREE(filtered);
+	s->err = 1;
+}
+
+#else /* HAVE_LIBZ */
+
+static void png_stripe(__attribute__((unused)) struct encode_job *job, struct stripe *s)
+{
+	s->err = 1;
+}
+
+#endif /* HAVE_LIBZ */
+
+static void encode_worker(__attribute__((unused)) int id, void *data)
+{
+	struct encode_job *job = (struct encode_job *) data;
+	uint64_t c;
+
+	while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < (uint64_t) job->nb_stripe) {
+		if (job->format == IMAGE_QOI)
+			qoi_stripe(job, &job->stripes[c]);
+		else
+			png_stripe(job, &job->stripes[c]);
+	}
+}
+
+static void put_u32(unsigned char *buf, uint32_t v)
+{
+	buf[0] = v >> 24;
+	buf[1] = v >> 16;
+	buf[2] = v >> 8;
+	buf[3] = v;
+}
+
+static void write_qoi(FILE *f, struct encode_job *job)
+{
+	static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+	int i;
+
+	put_u32(&header[4], job->width);
+	put_u32(&header[8], job->height);
+	header[12] = 3;
+	header[13] = 0;
+	fwrite(header, 1, sizeof(header), f);
+	for (i = 0; i < job->nb_stripe; i++)
+		fwrite(job->stripes[i].buf, 1, job->stripes[i].len, f);
+	fwrite(end, 1, sizeof(end), f);
+}
+
+#ifdef HAVE_LIBZ
+
+static void png_chunk(FILE *f, const char *type, const unsigned char *data, size_t len,
+		unsigned long crc)
+{
+	unsigned char buf[4];
+
+	put_u32(buf, len);
+	fwrite(buf, 1, 4, f);
+	fwrite(type, 1, 4, f);
+	if (len > 0)
+		fwrite(data, 1, len, f);
+	put_u32(buf, crc);
+	fwrite(buf, 1, 4, f);
+}
+
+static void write_png(FILE *f, struct encode_job *job)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	/* deflate, 32K window, default compression, no dictionary */
+	static const unsigned char zlib_header[2] = { 0x78, 0x9c };
+	unsigned char ihdr[13];
+	unsigned char adler[4];
+	unsigned long check = adler32(0L, Z_NULL, 0);
+	int i;
+
+	fwrite(signature, 1, sizeof(signature), f);
+	put_u32(&ihdr[0], job->width);
+	put_u32(&ihdr[4], job->height);
+	ihdr[8] = 8;	/* bits per channel */
+	ihdr[9] = 2;	/* RGB */
+	ihdr[10] = 0;
+	ihdr[11] = 0;
+	ihdr[12] = 0;
+	png_chunk(f, "IHDR", ihdr, sizeof(ihdr), png_crc("IHDR", ihdr, sizeof(ihdr)));
+	png_chunk(f, "IDAT", zlib_header, sizeof(zlib_header),
+			png_crc("IDAT", zlib_header, sizeof(zlib_header)));
+	for (i = 0; i < job->nb_stripe; i++) {
+		struct stripe *s = &job->stripes[i];
+		png_chunk(f, "IDAT", s->buf, s->len, s->crc);
+		check = adler32_combine(check, s->check, s->raw);
+	}
+	put_u32(adler, check);
+	png_chunk(f, "IDAT", adler, sizeof(adler), png_crc("IDAT", adler, sizeof(adler)));
+	png_chunk(f, "IEND", NULL, 0, png_crc("IEND", NULL, 0));
+}
+
+#else /* HAVE_LIBZ */
+
+static void write_png(__attribute__((unused)) FILE *f,
+		__attribute__((unused)) struct encode_job *job)
+{
+}
+
+#endif /* HAVE_LIBZ */
+
+long encode_img(struct rgb *image, char *file, int width, int height, int nb_thread)
+{
+	struct pool *pool = NULL;
+
+	/* PPM is written without the pool */
+	if (image_format_of(file) != IMAGE_PPM && (pool = pool_get(nb_thread)) == NULL) {
+		printf("pool init error\n");
+		return -1;
+	}
+	return encode_img_pool(pool, image, file, width, height);
+}
+
+long encode_img_pool(struct pool *pool, struct rgb *image, char *file, int width, int height)
+{
+	struct encode_job job;
+	FILE *f = NULL;
+	long size = -1;
+	int i;
+
+	memset(&job, 0, sizeof(job));
+	job.format = image_format_of(file);
+	if (job.format == IMAGE_PPM) {
+		if (write_img(image, file, width, height) < 0)
+			return -1;
+		/* header and pixels */
+		return snprintf(NULL, 0, "P6\n%d %d\n%d\n", width, height, 255) +
+				(long) sizeof(struct rgb) * width * height;
+	}
+#ifndef HAVE_LIBZ
+	if (job.format == IMAGE_PNG) {
+		printf("PNG output requires zlib\n");
+		return -1;
+	}
+#endif
+	if (image == NULL || width <= 0 || height <= 0)
+		return -1;
+
+	job.image = image;
+	job.width = width;
+	job.height = height;
+	job.nb_stripe = pool->nb_thread * ENCODE_STRIPES;
+	if (job.nb_stripe > height)
+		job.nb_stripe = height;
+	if ((job.stripes = calloc(job.nb_stripe, sizeof(struct stripe))) == NULL)
+		goto done;
+	for (i = 0; i < job.nb_stripe; i++) {
+		job.stripes[i].first = (uint64_t) i * height / job.nb_stripe;
+		job.stripes[i].last = (uint64_t) (i + 1) * height / job.nb_stripe;
+	}
+
+	pool_run(pool, encode_worker, &job);
+	for (i = 0; i < job.nb_stripe; i++) {
+		if (job.stripes[i].err) {
+			printf("%s encoding error\n", image_format_name(job.format));
+			goto done;
+		}
+	}
+
+	if ((f = fopen(file, "wb")) == NULL) {
+		perror(file);
+		goto done;
+	}
+	if (job.format == IMAGE_QOI)
+		write_qoi(f, &job);
+	else
+		write_png(f, &job);
+	size = ferror(f) ? -1 : ftell(f);
+	fclose(f);
+
+done:
+	for (i = 0; i < job.nb_stripe && job.stripes != NULL; i++)
+		FREE(job.stripes[i].buf);
+	FREE(job.stripes);
+	return size;
+}
+
+/*
+ * Decoders of the files written above, only the options they use: they check
+ * the stripes of the encoders, not arbitrary files.
+ */
+
+static uint32_t get_u32(const unsigned char *buf)
+{
+	return (uint32_t) buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+/* whole file in memory */
+static unsigned char *read_file(const char *file, size_t *len)
+{
+	unsigned char *buf = NULL;
+	FILE *f;
+	long n;
+
+	if ((f = fopen(file, "rb")) == NULL) {
+		perror(file);
+		return NULL;
+	}
+	if (fseek(f, 0, SEEK_END) < 0 || (n = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) < 0)
+		goto done;
+	if ((buf = malloc(n + 1)) == NULL)
+		goto done;
+	if (fread(buf, 1, n, f) != (size_t) n) {
+		FREE(buf);
+		goto done;
+	}
+	*len = n;
+done:
+	fclose(f);
+	return buf;
+}
+
+static struct rgb *decode_ppm(const unsigned char *buf, size_t len, int *width, int *height)
+{
+	struct rgb *image;
+	int max, n = 0;
+
+	if (sscanf((const char *) buf, "P6 %d %d %d%n", width, height, &max, &n) != 3 ||
+			n == 0 || max != 255 || *width <= 0 || *height <= 0)
+		return NULL;
+	/* a single white space ends the header */
+	n++;
+	if (len - n != sizeof(struct rgb) * *width * *height)
+		return NULL;
+	if ((image = make_canvas(*width, *height)) == NULL)
+		return NULL;
+	memcpy(image, buf + n, len - n);
+	return image;
+}
+
+static struct rgb *decode_qoi(const unsigned char *buf, size_t len, int *width, int *height)
+{
+	struct rgb index[64];
+	struct rgb px = { 0, 0, 0 };
+	struct rgb *image;
+	uint64_t p, area;
+	size_t i = 14;
+	int run = 0;
+
+	if (len < 22 || memcmp(buf, "qoif", 4) != 0 || buf[12] != 3)
+		return NULL;
+	*width = get_u32(&buf[4]);
+	*height = get_u32(&buf[8]);
+	area = (uint64_t) *width * *height;
+	if ((image = make_canvas(*width, *height)) == NULL)
+		return NULL;
+	memset(index, 0, sizeof(index));
+	for (p = 0; p < area; p++) {
+		if (run > 0) {
+			run--;
+		} else if (i < len - 8) {
+			int op = buf[i++];
+			if (op == QOI_OP_RGB + 1) {
+				/* RGBA, not written for an RGB image */
+				goto err;
+			} else if (op == QOI_OP_RGB) {
+				px.r = buf[i++];
+				px.g = buf[i++];
+				px.b = buf[i++];
+			} else if ((op & 0xc0) == QOI_OP_INDEX) {
+				px = index[op];
+			} else if ((op & 0xc0) == QOI_OP_DIFF) {
+				px.r += ((op >> 4) & 3) - 2;
+				px.g += ((op >> 2) & 3) - 2;
+				px.b += (op & 3) - 2;
+			} else if ((op & 0xc0) == QOI_OP_LUMA) {
+				int vg = (op & 0x3f) - 32;
+				int next = buf[i++];
+				px.r += vg - 8 + ((next >> 4) & 0x0f);
+				px.g += vg;
+				px.b += vg - 8 + (next & 0x0f);
+			} else {
+				run = op & 0x3f;
+			}
+			index[QOI_HASH(px)] = px;
+		} else {
+			goto err;
+		}
+		image[p] = px;
+	}
+	/* every op is used, then the end marker */
+	if (i != len - 8 || run != 0 || buf[len - 1] != 1)
+		goto err;
+	return image;
+err:
+	FREE(image);
+	return NULL;
+}
+
+#ifdef HAVE_LIBZ
+
+static inline int png_paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+static struct rgb *decode_png(const unsigned char *buf, size_t len, int *width, int *height)
+{
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	unsigned char *raw = NULL;
+	struct rgb *image = NULL;
+	size_t row = 0, i = 8;
+	z_stream z;
+	int end = 0;
+	int ret = Z_DATA_ERROR;
+	int y, x;
+
+	memset(&z, 0, sizeof(z));
+	if (len < 8 || memcmp(buf, signature, 8) != 0 || inflateInit(&z) != Z_OK)
+		return NULL;
+	while (!end && i + 12 <= len) {
+		uint32_t n = get_u32(&buf[i]);
+		const char *type = (const char *) &buf[i + 4];
+		const unsigned char *data = &buf[i + 8];
+
+		if (n > len - i - 12 || png_crc(type, data, n) != get_u32(&data[n]))
+			goto err;
+		if (memcmp(type, "IHDR", 4) == 0) {
+			/* 8 bits RGB, not interlaced, as written by write_png */
+			if (n != 13 || data[8] != 8 || data[9] != 2 || data[12] != 0 || raw != NULL)
+				goto err;
+			*width = get_u32(&data[0]);
+			*height = get_u32(&data[4]);
+			row = 1 + sizeof(struct rgb) * *width;
+			if ((raw = malloc(row * *height)) == NULL ||
+					(image = make_canvas(*width, *height)) == NULL)
+				goto err;
+			z.next_out = raw;
+			z.avail_out = row * *height;
+		} else if (memcmp(type, "IDAT", 4) == 0) {
+			if (raw == NULL || ret == Z_STREAM_END)
+				goto err;
+			z.next_in = (Bytef *) data;
+			z.avail_in = n;
+			/* checks the adler32 of the stream at its end */
+			ret = inflate(&z, Z_NO_FLUSH);
+			if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) || z.avail_in != 0)
+				goto err;
+		} else if (memcmp(type, "IEND", 4) == 0) {
+			end = 1;
+		}
+		i += 12 + n;
+	}
+	if (!end || ret != Z_STREAM_END || z.avail_out != 0)
+		goto err;
+	inflateEnd(&z);
+
+	for (y = 0; y < *height; y++) {
+		unsigned char *cur = &raw[y * row + 1];
+		unsigned char *up = y > 0 ? cur - row : NULL;
+		unsigned char *dst = (unsigned char *) &image[(uint64_t) y * *width];
+		for (x = 0; x < (int) (row - 1); x++) {
+			int a = x >= 3 ? dst[x - 3] : 0;
+			int b = up != NULL ? dst[x - (int) (row - 1)] : 0;
+			int c = up != NULL && x >= 3 ? dst[x - 3 - (int) (row - 1)] : 0;
+			switch (cur[-1]) {
+			case 0: dst[x] = cur[x]; break;
+			case 1: dst[x] = cur[x] + a; break;
+			case 2: dst[x] = cur[x] + b; break;
+			case 3: dst[x] = cur[x] + ((a + b) >> 1); break;
+			case 4: dst[x] = cur[x] + png_paeth(a, b, c); break;
+			default: goto err_image;
+			}
+		}
+	}
+	FREE(raw);
+	return image;
+err:
+	inflateEnd(&z);
+err_image:
+	FREE(raw);
+	FREE(image);
+	return NULL;
+}
+
+#else /* HAVE_LIBZ */
+
+static struct rgb *decode_png(__attribute__((unused)) const unsigned char *buf,
+		__attribute__((unused)) size_t len, __attribute__((unused)) int *width,
+		__attribute__((unused)) int *height)
+{
+	printf("PNG input requires zlib\n");
+	return NULL;
+}
+
+#endif /* HAVE_LIBZ */
+
+struct rgb *decode_img(const char *file, int *width, int *height)
+{
+	struct rgb *image = NULL;
+	unsigned char *buf;
+	size_t len;
+
+	if ((buf = read_file(file, &len)) == NULL)
+		return NULL;
+	/* the header of a PPM is text */
+	buf[len] = '\0';
+	switch (image_format_of(file)) {
+	case IMAGE_QOI:
+		image = decode_qoi(buf, len, width, height);
+		break;
+	case IMAGE_PNG:
+		image = decode_png(buf, len, width, height);
+		break;
+	case IMAGE_PPM:
+	default:
+		image = decode_ppm(buf, len, width, height);
+		break;
+	}
+	FREE(buf);
+	if (image == NULL)
+		printf("%s: invalid %s file\n", file, image_format_name(image_format_of(file)));
+	return image;
+}
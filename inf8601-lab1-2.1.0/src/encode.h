@@ -0,0 +1,38 @@
+/*
+ * encode.h
+ *
+ *  Image encoders of the dragonizer output, selected by file extension
+ */
+
+#ifndef ENCODE_H_
+#define ENCODE_H_
+
+#include <stddef.h>
+
+#include "color.h"
+#include "pool.h"
+
+enum image_format {
+	IMAGE_PPM,
+	IMAGE_QOI,
+	IMAGE_PNG,
+};
+
+/* .qoi and .png files, anything else is PPM */
+enum image_format image_format_of(const char *file);
+const char *image_format_name(enum image_format format);
+/*
+ * Encode the image to file on the pthread pool of nb_thread workers.
+ * Returns the size of the file, -1 on error.
+ */
+long encode_img(struct rgb *image, char *file, int width, int height, int nb_thread);
+/* same as encode_img, on the workers of pool */
+long encode_img_pool(struct pool *pool, struct rgb *image, char *file, int width, int height);
+
+/*
+ * Read back an image written by encode_img, for check. Returns the pixels,
+ * to free, and their size in width and height, NULL on error.
+ */
+struct rgb *decode_img(const char *file, int *width, int *height);
+
+#endif /* ENCODE_H_ */
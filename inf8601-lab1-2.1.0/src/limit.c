@@ -0,0 +1,187 @@
+/*
+ * limit.c
+ *
+ * piece_limit over aligned blocks of LIMIT_BLOCK segments. The orientation
+ * is a 2-bit state, rotate_left adding 1 and rotate_right 3. Inside a block,
+ * the turns are given by the bits of the offset of the segment, except the
+ * middle turn given by the bit LIMIT_BLOCK_SHIFT of the start: the prefix
+ * sums of the moves of the block, and their bounding box, only depend on
+ * this bit and on the starting state, and are computed once. Each block
+ * then costs one min/max of its box, done on vectors of 4 lanes (min x,
+ * min y, -max x, -max y), and the decoding of the turn following it. The
+ * vector kernels are selected at load time according to the CPU. The
+ * cells of the segments of the blocks are in the same table, for the draw
+ * kernels of dragon.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LIMIT_X86
+#endif
+
+#include "limit.h"
+
+struct limit_block limit_blocks_table[2][4];
+
+const xy_t state_orientations[4] = { { 1, 1 }, { -1, 1 }, { -1, -1 }, { 1, -1 } };
+
+limit_blocks_t limit_blocks = limit_blocks_scalar;
+
+/* 1 for a left turn after the segment n - 1, 3 for a right turn */
+static inline int limit_turn(uint64_t n)
+{
+	return 3 - 2 * !!(((n & -n) << 1) & n);
+}
+
+static limit_blocks_t limit_blocks_select(void);
+
+/*
+ * Prefix sums of the moves and cells of each block, and the kernel, once
+ * before main: the threads only read them.
+ */
+static void __attribute__((constructor)) limit_blocks_init(void)
+{
+	int b, s, u;
+
+	for (b = 0; b < 2; b++) {
+		for (s = 0; s < 4; s++) {
+			struct limit_block *block = &limit_blocks_table[b][s];
+			uint64_t n = (uint64_t) b << LIMIT_BLOCK_SHIFT;
+			int64_t x = 0, y = 0;
+			int state = s;
+			block->box[0] = block->box[1] = INT64_MAX;
+			block->box[2] = block->box[3] = INT64_MAX;
+			block->min_x = block->min_y = INT8_MAX;
+			block->max_x = block->max_y = INT8_MIN;
+			for (u = 1; u <= LIMIT_BLOCK; u++) {
+				/* cell crossed by the segment u - 1 */
+				int8_t dx = (x + (x + state_orientations[state].x)) >> 1;
+				int8_t dy = (y + (y + state_orientations[state].y)) >> 1;
+				block->dx[u - 1] = dx;
+				block->dy[u - 1] = dy;
+				if (block->min_x > dx) block->min_x = dx;
+				if (block->min_y > dy) block->min_y = dy;
+				if (block->max_x < dx) block->max_x = dx;
+				if (block->max_y < dy) block->max_y = dy;
+				x += state_orientations[state].x;
+				y += state_orientations[state].y;
+				if (block->box[0] > x) block->box[0] = x;
+				if (block->box[1] > y) block->box[1] = y;
+				if (block->box[2] > -x) block->box[2] = -x;
+				if (block->box[3] > -y) block->box[3] = -y;
+				if (u < LIMIT_BLOCK)
+					state = (state + limit_turn(n + u)) & 3;
+			}
+			block->move[0] = x;
+			block->move[1] = y;
+			block->move[2] = -x;
+			block->move[3] = -y;
+			block->state = state;
+		}
+	}
+	limit_blocks = limit_blocks_select();
+}
+
+void limit_blocks_scalar(uint64_t start, uint64_t end, piece_t *m)
+{
+	int64_t pos[4] = { m->position.x, m->position.y, -m->position.x, -m->position.y };
+	int64_t acc[4] = { m->limits.minimums.x, m->limits.minimums.y,
+			-m->limits.maximums.x, -m->limits.maximums.y };
+	int state = orientation_state(m->orientation);
+	uint64_t n;
+	int k;
+
+	for (n = start; n < end; n += LIMIT_BLOCK) {
+		const struct limit_block *block = &limit_blocks_table[(n >> LIMIT_BLOCK_SHIFT) & 1][state];
+		for (k = 0; k < 4; k++) {
+			int64_t v = pos[k] + block->box[k];
+			acc[k] = v < acc[k] ? v : acc[k];
+			pos[k] += block->move[k];
+		}
+		state = (block->state + limit_turn(n + LIMIT_BLOCK)) & 3;
+	}
+	m->position.x = pos[0];
+	m->position.y = pos[1];
+	m->orientation = state_orientations[state];
+	m->limits.minimums.x = acc[0];
+	m->limits.minimums.y = acc[1];
+	m->limits.maximums.x = -acc[2];
+	m->limits.maximums.y = -acc[3];
+}
+
+#ifdef LIMIT_X86
+
+__attribute__((target("avx2")))
+static inline void limit_store(piece_t *m, __m256i pos, __m256i acc, int state)
+{
+	int64_t lanes[4];
+
+	_mm256_storeu_si256((__m256i *) lanes, pos);
+	m->position.x = lanes[0];
+	m->position.y = lanes[1];
+	m->orientation = state_orientations[state];
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	m->limits.minimums.x = lanes[0];
+	m->limits.minimums.y = lanes[1];
+	m->limits.maximums.x = -lanes[2];
+	m->limits.maximums.y = -lanes[3];
+}
+
+/* AVX2 has no 64 bits min, it is a compare and a blend */
+__attribute__((target("avx2")))
+static void limit_blocks_avx2(uint64_t start, uint64_t end, piece_t *m)
+{
+	__m256i pos = _mm256_set_epi64x(-m->position.y, -m->position.x,
+			m->position.y, m->position.x);
+	__m256i acc = _mm256_set_epi64x(-m->limits.maximums.y, -m->limits.maximums.x,
+			m->limits.minimums.y, m->limits.minimums.x);
+	int state = orientation_state(m->orientation);
+	uint64_t n;
+
+	for (n = start; n < end; n += LIMIT_BLOCK) {
+		const struct limit_block *block = &limit_blocks_table[(n >> LIMIT_BLOCK_SHIFT) & 1][state];
+		__m256i v = _mm256_add_epi64(pos, _mm256_load_si256((const __m256i *) block->box));
+		acc = _mm256_blendv_epi8(acc, v, _mm256_cmpgt_epi64(acc, v));
+		pos = _mm256_add_epi64(pos, _mm256_load_si256((const __m256i *) block->move));
+		state = (block->state + limit_turn(n + LIMIT_BLOCK)) & 3;
+	}
+	limit_store(m, pos, acc, state);
+}
+
+__attribute__((target("avx2,avx512f,avx512vl")))
+static void limit_blocks_avx512(uint64_t start, uint64_t end, piece_t *m)
+{
+	__m256i pos = _mm256_set_epi64x(-m->position.y, -m->position.x,
+			m->position.y, m->position.x);
+	__m256i acc = _mm256_set_epi64x(-m->limits.maximums.y, -m->limits.maximums.x,
+			m->limits.minimums.y, m->limits.minimums.x);
+	int state = orientation_state(m->orientation);
+	uint64_t n;
+
+	for (n = start; n < end; n += LIMIT_BLOCK) {
+		const struct limit_block *block = &limit_blocks_table[(n >> LIMIT_BLOCK_SHIFT) & 1][state];
+		__m256i v = _mm256_add_epi64(pos, _mm256_load_si256((const __m256i *) block->box));
+		acc = _mm256_min_epi64(acc, v);
+		pos = _mm256_add_epi64(pos, _mm256_load_si256((const __m256i *) block->move));
+		state = (block->state + limit_turn(n + LIMIT_BLOCK)) & 3;
+	}
+	limit_store(m, pos, acc, state);
+}
+
+#endif /* LIMIT_X86 */
+
+static limit_blocks_t limit_blocks_select(void)
+{
+#ifdef LIMIT_X86
+	/* constructors may run before the one of libgcc */
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+		return limit_blocks_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return limit_blocks_avx2;
+#endif
+	return limit_blocks_scalar;
+}
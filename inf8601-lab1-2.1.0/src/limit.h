@@ -0,0 +1,64 @@
+/*
+ * limit.h
+ *
+ *  Table of the aligned blocks of segments, and the kernels used by
+ *  piece_limit
+ */
+
+#ifndef LIMIT_H_
+#define LIMIT_H_
+
+#include <stdint.h>
+#include "dragon.h"
+
+#define LIMIT_BLOCK_SHIFT	4
+#define LIMIT_BLOCK			(1 << LIMIT_BLOCK_SHIFT)
+
+/*
+ * An aligned block of LIMIT_BLOCK segments, the same for all the starts with
+ * the same bit LIMIT_BLOCK_SHIFT and starting state. The orientation is a
+ * 2-bit state, rotate_left adding 1 and rotate_right 3.
+ */
+struct limit_block {
+	/* box of the positions after each move: min x, min y, -max x, -max y */
+	int64_t box[4];
+	/* position after the block, as x, y, -x, -y */
+	int64_t move[4];
+	/* cell of each segment, from the start position, and their box */
+	int8_t dx[LIMIT_BLOCK];
+	int8_t dy[LIMIT_BLOCK];
+	int8_t min_x;
+	int8_t min_y;
+	int8_t max_x;
+	int8_t max_y;
+	/* state of the last segment, before the turn following the block */
+	int state;
+} __attribute__((aligned(32)));
+
+/* [bit LIMIT_BLOCK_SHIFT of the start][state], filled at load time */
+extern struct limit_block limit_blocks_table[2][4];
+extern const xy_t state_orientations[4];
+
+/* sign bits of the orientation give 0, 1, 3, 2, a Gray code of the state */
+static inline int orientation_state(xy_t orientation)
+{
+	int sign = (orientation.x < 0) | ((orientation.y < 0) << 1);
+	return sign ^ (sign >> 1);
+}
+
+static inline const struct limit_block *limit_block_at(uint64_t start, xy_t orientation)
+{
+	return &limit_blocks_table[(start >> LIMIT_BLOCK_SHIFT) & 1][orientation_state(orientation)];
+}
+
+/*
+ * Move the piece m over the segments [start, end), both multiples of
+ * LIMIT_BLOCK, extending its limits like piece_limit.
+ */
+typedef void (*limit_blocks_t)(uint64_t start, uint64_t end, piece_t *m);
+
+/* kernel of the CPU, selected at load time */
+extern limit_blocks_t limit_blocks;
+void limit_blocks_scalar(uint64_t start, uint64_t end, piece_t *m);
+
+#endif /* LIMIT_H_ */
@@ -0,0 +1,187 @@
+/*
+ * metrics.c
+ *
+ * Wall-clock timings of the phases of a run and of the threads working in
+ * them, reported as one JSON or CSV record.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "dragon.h"
+#include "metrics.h"
+#include "perfctr.h"
+
+static const char *phase_names[METRICS_PHASE_COUNT] = {
+		"limits", "clear", "draw", "render", "write",
+};
+
+static double phases[METRICS_PHASE_COUNT];
+static double threads[METRICS_THREAD_MAX];
+
+const char *metrics_phase_name(enum metrics_phase phase)
+{
+	return phase_names[phase];
+}
+
+double metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+void metrics_reset(void)
+{
+	memset(phases, 0, sizeof(phases));
+	memset(threads, 0, sizeof(threads));
+	perfctr_reset();
+}
+
+void metrics_phase(enum metrics_phase phase, double ms)
+{
+	phases[phase] += ms;
+}
+
+double metrics_phase_ms(enum metrics_phase phase)
+{
+	return phases[phase];
+}
+
+void metrics_thread(int id, double ms)
+{
+	if (id >= 0 && id < METRICS_THREAD_MAX)
+		threads[id] += ms;
+}
+
+int metrics_format_parse(const char *name, enum metrics_format *format)
+{
+	if (strcmp(name, "json") == 0)
+		*format = METRICS_JSON;
+	else if (strcmp(name, "csv") == 0)
+		*format = METRICS_CSV;
+	else
+		return -1;
+	return 0;
+}
+
+/* peak resident set size of the process, in kilobytes */
+static long peak_rss(void)
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return -1;
+	return usage.ru_maxrss;
+}
+
+void metrics_report(FILE *f, enum metrics_format format, const char *lib,
+		uint64_t size, int nb_thread)
+{
+	static int csv_header = 0;
+	double total = 0;
+	double rate = 0;
+	int nb = nb_thread < METRICS_THREAD_MAX ? nb_thread : METRICS_THREAD_MAX;
+	int i;
+
+	perfctr_report(f);
+	if (format == METRICS_NONE)
+		return;
+
+	for (i = 0; i < METRICS_PHASE_COUNT; i++)
+		total += phases[i];
+	if (phases[METRICS_DRAW] > 0)
+		rate = size / (phases[METRICS_DRAW] / 1000);
+
+	if (format == METRICS_JSON) {
+		fprintf(f, "{\"lib\":\"%s\",\"size\":%" PRIu64 ",\"thread\":%d,\"layout\":\"%s\"",
+				lib, size, nb_thread, canvas_layout_name(canvas_layout));
+		for (i = 0; i < METRICS_PHASE_COUNT; i++)
+			fprintf(f, ",\"%s_ms\":%.3f", phase_names[i], phases[i]);
+		fprintf(f, ",\"total_ms\":%.3f,\"segments_per_s\":%.0f,\"peak_rss_kb\":%ld,\"thread_ms\":[",
+				total, rate, peak_rss());
+		for (i = 0; i < nb; i++)
+			fprintf(f, "%s%.3f", i ? "," : "", threads[i]);
+		fprintf(f, "]}\n");
+	} else {
+		if (!csv_header) {
+			fprintf(f, "lib,size,thread,layout");
+			for (i = 0; i < METRICS_PHASE_COUNT; i++)
+				fprintf(f, ",%s_ms", phase_names[i]);
+			fprintf(f, ",total_ms,segments_per_s,peak_rss_kb,thread_ms\n");
+			csv_header = 1;
+		}
+		fprintf(f, "%s,%" PRIu64 ",%d,%s", lib, size, nb_thread,
+				canvas_layout_name(canvas_layout));
+		for (i = 0; i < METRICS_PHASE_COUNT; i++)
+			fprintf(f, ",%.3f", phases[i]);
+		/* thread times are ';' separated in the last column */
+		fprintf(f, ",%.3f,%.0f,%ld,", total, rate, peak_rss());
+		for (i = 0; i < nb; i++)
+			fprintf(f, "%s%.3f", i ? ";" : "", threads[i]);
+		fprintf(f, "\n");
+	}
+	fflush(f);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* samples further than this many deviations from the median are outliers */
+#define METRICS_OUTLIER_MADS	5
+
+/*
+ * Sort the samples and move those within METRICS_OUTLIER_MADS median
+ * absolute deviations (scaled to a normal stddev) of the median to the
+ * front, returning their number. A preempted run is much slower, a glitch
+ * of the clock much faster: both would skew the minimums of a baseline.
+ */
+int metrics_reject_outliers(double *samples, int n)
+{
+	double *dev, median, mad;
+	int i, kept = 0;
+
+	if (n < 3 || (dev = (double *) malloc(n * sizeof(double))) == NULL)
+		return n;
+	qsort(samples, n, sizeof(double), cmp_double);
+	median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	for (i = 0; i < n; i++)
+		dev[i] = fabs(samples[i] - median);
+	qsort(dev, n, sizeof(double), cmp_double);
+	mad = 1.4826 * (n % 2 ? dev[n / 2] : (dev[n / 2 - 1] + dev[n / 2]) / 2);
+	free(dev);
+	for (i = 0; i < n; i++) {
+		if (fabs(samples[i] - median) <= METRICS_OUTLIER_MADS * mad)
+			samples[kept++] = samples[i];
+	}
+	return kept;
+}
+
+void metrics_summarize(double *samples, int n, struct metrics_summary *summary)
+{
+	double var = 0;
+	int i;
+
+	memset(summary, 0, sizeof(struct metrics_summary));
+	if (n <= 0)
+		return;
+	qsort(samples, n, sizeof(double), cmp_double);
+	for (i = 0; i < n; i++)
+		summary->mean += samples[i];
+	summary->mean /= n;
+	for (i = 0; i < n; i++)
+		var += (samples[i] - summary->mean) * (samples[i] - summary->mean);
+	summary->stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+	summary->min = samples[0];
+	if (n % 2)
+		summary->median = samples[n / 2];
+	else
+		summary->median = (samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
@@ -0,0 +1,60 @@
+/*
+ * metrics.h
+ *
+ *  Wall-clock timings of a dragonizer run
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum metrics_phase {
+	METRICS_LIMITS,
+	METRICS_CLEAR,
+	METRICS_DRAW,
+	METRICS_RENDER,
+	METRICS_WRITE,
+	METRICS_PHASE_COUNT,
+};
+
+enum metrics_format {
+	METRICS_NONE,
+	METRICS_JSON,
+	METRICS_CSV,
+};
+
+/* threads over this id are not reported */
+#define METRICS_THREAD_MAX 256
+
+struct metrics_summary {
+	double median;
+	double min;
+	double mean;
+	double stddev;
+};
+
+const char *metrics_phase_name(enum metrics_phase phase);
+/* monotonic clock, in milliseconds */
+double metrics_now(void);
+void metrics_reset(void);
+/* add ms to a phase, called by the thread driving the run */
+void metrics_phase(enum metrics_phase phase, double ms);
+/* ms of a phase since metrics_reset() */
+double metrics_phase_ms(enum metrics_phase phase);
+/* add ms of work to thread id, each id used by a single thread at a time */
+void metrics_thread(int id, double ms);
+int metrics_format_parse(const char *name, enum metrics_format *format);
+/*
+ * print one record for the phases and threads since metrics_reset(),
+ * preceded by the hardware counters with --perf-counters
+ */
+void metrics_report(FILE *f, enum metrics_format format, const char *lib,
+		uint64_t size, int nb_thread);
+/* statistics of n samples, sorts the samples */
+void metrics_summarize(double *samples, int n, struct metrics_summary *summary);
+/* moves the samples close to the median to the front, returns their number */
+int metrics_reject_outliers(double *samples, int n);
+
+#endif /* METRICS_H_ */
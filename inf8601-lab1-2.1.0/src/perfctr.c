@@ -0,0 +1,262 @@
+/*
+ * perfctr.c
+ *
+ * Hardware counters of the threads of a run, with perf_event_open(2).
+ *
+ * Each thread opens its own group of counters the first time it samples
+ * after a reset, and reads the whole group at the begin and at the end of
+ * each piece of work. The difference is added to the counts of the thread
+ * for the phase of the work, scaled by enabled / running time when the
+ * kernel multiplexes the counters.
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "dragon.h"
+#include "utils.h"
+#include "perfctr.h"
+
+struct perfctr_def {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+static const struct perfctr_def events[PERFCTR_EVENT_COUNT] = {
+		{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ "llc-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ "dtlb-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				(PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+		{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+/* layout of a read of a group with the enabled and running times */
+struct perfctr_read {
+	uint64_t nr;
+	uint64_t enabled;
+	uint64_t running;
+	uint64_t values[PERFCTR_EVENT_COUNT];
+};
+
+struct perfctr_slot {
+	int tid;
+	int fd[PERFCTR_EVENT_COUNT];
+	/* position of each event in a group read, -1 if it is not counted */
+	int index[PERFCTR_EVENT_COUNT];
+	struct perfctr_read begin;
+	double counts[METRICS_PHASE_COUNT][PERFCTR_EVENT_COUNT];
+} __attribute__((aligned(64)));
+
+int perfctr_enabled = 0;
+
+/* events the probe of perfctr_enable() could open */
+static int supported[PERFCTR_EVENT_COUNT];
+static struct perfctr_slot slots[METRICS_THREAD_MAX];
+static int nb_slots = 0;
+/* a thread opens its group again when it does not match the slot generation */
+static unsigned int generation = 1;
+static __thread struct perfctr_slot *self = NULL;
+static __thread unsigned int self_generation = 0;
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+	return syscall(__NR_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+static void slot_close(struct perfctr_slot *slot)
+{
+	int e;
+	for (e = 0; e < PERFCTR_EVENT_COUNT; e++) {
+		if (slot->fd[e] >= 0)
+			close(slot->fd[e]);
+		slot->fd[e] = -1;
+		slot->index[e] = -1;
+	}
+}
+
+/*
+ * Open the counters of the calling thread in one group, led by the first
+ * event that opens. Returns the number of events counted.
+ */
+static int slot_open(struct perfctr_slot *slot)
+{
+	struct perf_event_attr attr;
+	int leader = -1;
+	int nr = 0;
+	int e;
+
+	slot->tid = gettid();
+	for (e = 0; e < PERFCTR_EVENT_COUNT; e++) {
+		slot->fd[e] = -1;
+		slot->index[e] = -1;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[e].type;
+		attr.config = events[e].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+				PERF_FORMAT_TOTAL_TIME_RUNNING;
+		slot->fd[e] = perf_event_open(&attr, leader);
+		if (slot->fd[e] < 0)
+			continue;
+		if (leader < 0)
+			leader = slot->fd[e];
+		slot->index[e] = nr++;
+	}
+	return nr;
+}
+
+static int slot_read(struct perfctr_slot *slot, struct perfctr_read *r)
+{
+	int e;
+	for (e = 0; e < PERFCTR_EVENT_COUNT; e++) {
+		if (slot->index[e] == 0)
+			return read(slot->fd[e], r, sizeof(struct perfctr_read)) > 0 ? 0 : -1;
+	}
+	return -1;
+}
+
+int perfctr_enable(void)
+{
+	struct perfctr_slot probe;
+	int e;
+
+	if (slot_open(&probe) == 0) {
+		fprintf(stderr, "perf counters unavailable: %s", strerror(errno));
+		if (errno == EACCES || errno == EPERM)
+			fprintf(stderr, ", see /proc/sys/kernel/perf_event_paranoid");
+		fprintf(stderr, "\n");
+		return -1;
+	}
+	for (e = 0; e < PERFCTR_EVENT_COUNT; e++) {
+		supported[e] = probe.index[e] >= 0;
+		if (!supported[e])
+			fprintf(stderr, "perf counter %s unavailable\n", events[e].name);
+	}
+	slot_close(&probe);
+	perfctr_enabled = 1;
+	perfctr_reset();
+	return 0;
+}
+
+void perfctr_reset(void)
+{
+	int i;
+
+	if (!perfctr_enabled)
+		return;
+	for (i = 0; i < nb_slots && i < METRICS_THREAD_MAX; i++)
+		slot_close(&slots[i]);
+	memset(slots, 0, sizeof(slots));
+	nb_slots = 0;
+	generation++;
+}
+
+/* slot of the calling thread, NULL if its counters can not be opened */
+static struct perfctr_slot *slot_self(void)
+{
+	int id;
+
+	if (self_generation == generation)
+		return self;
+	self_generation = generation;
+	self = NULL;
+	id = __atomic_fetch_add(&nb_slots, 1, __ATOMIC_RELAXED);
+	if (id >= METRICS_THREAD_MAX)
+		return NULL;
+	if (slot_open(&slots[id]) > 0)
+		self = &slots[id];
+	return self;
+}
+
+void perfctr_begin(__attribute__((unused)) enum metrics_phase phase)
+{
+	struct perfctr_slot *slot = slot_self();
+	if (slot != NULL)
+		slot_read(slot, &slot->begin);
+}
+
+void perfctr_end(enum metrics_phase phase)
+{
+	struct perfctr_slot *slot = slot_self();
+	struct perfctr_read end;
+	double scale;
+	int e;
+
+	if (slot == NULL || slot_read(slot, &end) < 0)
+		return;
+	/* the group was not scheduled at all during the work */
+	if (end.running == slot->begin.running)
+		return;
+	scale = (double) (end.enabled - slot->begin.enabled) /
+			(end.running - slot->begin.running);
+	for (e = 0; e < PERFCTR_EVENT_COUNT; e++) {
+		int k = slot->index[e];
+		if (k >= 0)
+			slot->counts[phase][e] += (end.values[k] - slot->begin.values[k]) * scale;
+	}
+}
+
+static void print_ratio(FILE *f, double num, double den, int width, double unit, int event)
+{
+	if (!supported[event] || den == 0)
+		fprintf(f, " %*s", width, "-");
+	else
+		fprintf(f, " %*.3f", width, num * unit / den);
+}
+
+static void print_counts(FILE *f, const char *phase, const char *thread, double *counts)
+{
+	fprintf(f, "%-8s %8s %14.0f %14.0f", phase, thread, counts[PERFCTR_CYCLES],
+			counts[PERFCTR_INSTRUCTIONS]);
+	print_ratio(f, counts[PERFCTR_INSTRUCTIONS], counts[PERFCTR_CYCLES], 6, 1,
+			PERFCTR_INSTRUCTIONS);
+	print_ratio(f, counts[PERFCTR_LLC_MISSES], counts[PERFCTR_INSTRUCTIONS], 9, 1000,
+			PERFCTR_LLC_MISSES);
+	print_ratio(f, counts[PERFCTR_DTLB_MISSES], counts[PERFCTR_INSTRUCTIONS], 9, 1000,
+			PERFCTR_DTLB_MISSES);
+	print_ratio(f, counts[PERFCTR_BRANCH_MISSES], counts[PERFCTR_INSTRUCTIONS], 9, 1000,
+			PERFCTR_BRANCH_MISSES);
+	fprintf(f, "\n");
+}
+
+void perfctr_report(FILE *f)
+{
+	int nb = nb_slots < METRICS_THREAD_MAX ? nb_slots : METRICS_THREAD_MAX;
+	char tid[16];
+	int p, i, e;
+
+	if (!perfctr_enabled)
+		return;
+
+	/* misses are per thousand instructions */
+	fprintf(f, "%-8s %8s %14s %14s %6s %9s %9s %9s\n", "phase", "tid", "cycles",
+			"instructions", "ipc", "llc/ki", "dtlb/ki", "branch/ki");
+	for (p = 0; p < METRICS_PHASE_COUNT; p++) {
+		double total[PERFCTR_EVENT_COUNT];
+		int threads = 0;
+
+		memset(total, 0, sizeof(total));
+		for (i = 0; i < nb; i++) {
+			if (slots[i].counts[p][PERFCTR_CYCLES] == 0 &&
+					slots[i].counts[p][PERFCTR_INSTRUCTIONS] == 0)
+				continue;
+			snprintf(tid, sizeof(tid), "%d", slots[i].tid);
+			print_counts(f, metrics_phase_name(p), tid, slots[i].counts[p]);
+			for (e = 0; e < PERFCTR_EVENT_COUNT; e++)
+				total[e] += slots[i].counts[p][e];
+			threads++;
+		}
+		if (threads > 1)
+			print_counts(f, metrics_phase_name(p), "all", total);
+	}
+	fflush(f);
+}
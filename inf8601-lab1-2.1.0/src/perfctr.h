@@ -0,0 +1,44 @@
+/*
+ * perfctr.h
+ *
+ *  Hardware performance counters of the phases of a dragonizer run
+ */
+
+#ifndef PERFCTR_H_
+#define PERFCTR_H_
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "metrics.h"
+
+enum perfctr_event {
+	PERFCTR_CYCLES,
+	PERFCTR_INSTRUCTIONS,
+	PERFCTR_LLC_MISSES,
+	PERFCTR_DTLB_MISSES,
+	PERFCTR_BRANCH_MISSES,
+	PERFCTR_EVENT_COUNT,
+};
+
+/* set by perfctr_enable(), tested before each sample */
+extern int perfctr_enabled;
+
+/* open the counters of the calling thread, -1 if they are unavailable */
+int perfctr_enable(void);
+/* forget the counts and the counters opened since the last reset */
+void perfctr_reset(void);
+/* count the work of the calling thread between begin and end in phase */
+void perfctr_begin(enum metrics_phase phase);
+void perfctr_end(enum metrics_phase phase);
+/* print IPC and misses per kilo-instructions, per phase and per thread */
+void perfctr_report(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PERFCTR_H_ */
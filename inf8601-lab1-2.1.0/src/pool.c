@@ -0,0 +1,157 @@
+/*
+ * pool.c
+ *
+ * Workers are created once and wait for tasks. A task is run by every
+ * worker with its id; pool_wait returns when all of them are done, which
+ * also acts as a barrier between two tasks.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+struct worker_data {
+	struct pool *pool;
+	int id;
+};
+
+static struct pool *global_pool = NULL;
+
+static void *pool_worker(void *data)
+{
+	struct worker_data *worker = (struct worker_data *) data;
+	struct pool *pool = worker->pool;
+	int id = worker->id;
+	unsigned long generation = 0;
+
+	free(worker);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->stop)
+			pthread_cond_wait(&pool->start, &pool->lock);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		generation = pool->generation;
+		pool_task task = pool->task;
+		void *arg = pool->arg;
+		pthread_mutex_unlock(&pool->lock);
+
+		task(id, arg);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+struct pool *pool_create(int nb_thread)
+{
+	struct pool *pool;
+	int i;
+
+	if ((pool = calloc(1, sizeof(struct pool))) == NULL)
+		return NULL;
+	if ((pool->threads = calloc(nb_thread, sizeof(pthread_t))) == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 0; i < nb_thread; i++) {
+		struct worker_data *worker = malloc(sizeof(struct worker_data));
+		if (worker == NULL)
+			break;
+		worker->pool = pool;
+		worker->id = i;
+		if (pthread_create(&pool->threads[i], NULL, pool_worker, worker) != 0) {
+			free(worker);
+			break;
+		}
+		pool->nb_thread++;
+	}
+	if (pool->nb_thread != nb_thread) {
+		printf("pool: thread creation error\n");
+		pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+static void pool_atexit(void)
+{
+	pool_destroy(global_pool);
+	global_pool = NULL;
+}
+
+/*
+ * Process wide pool, created at the first call and kept while the number
+ * of threads does not change.
+ */
+struct pool *pool_get(int nb_thread)
+{
+	static int registered = 0;
+
+	if (global_pool != NULL && global_pool->nb_thread == nb_thread)
+		return global_pool;
+
+	pool_destroy(global_pool);
+	global_pool = pool_create(nb_thread);
+	if (!registered) {
+		atexit(pool_atexit);
+		registered = 1;
+	}
+	return global_pool;
+}
+
+void pool_dispatch(struct pool *pool, pool_task task, void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->arg = arg;
+	pool->pending = pool->nb_thread;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(struct pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_run(struct pool *pool, pool_task task, void *arg)
+{
+	pool_dispatch(pool, task, arg);
+	pool_wait(pool);
+}
+
+void pool_destroy(struct pool *pool)
+{
+	int i;
+
+	if (pool == NULL)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nb_thread; i++)
+		pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->start);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+	free(pool);
+}
@@ -0,0 +1,35 @@
+/*
+ * pool.h
+ *
+ *  Persistent pool of pthread workers
+ */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+
+typedef void (*pool_task)(int id, void *arg);
+
+struct pool {
+	int nb_thread;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long generation;
+	int pending;
+	int stop;
+	pool_task task;
+	void *arg;
+};
+
+/* private pool, for the threads that run tasks beside the global pool */
+struct pool *pool_create(int nb_thread);
+struct pool *pool_get(int nb_thread);
+void pool_dispatch(struct pool *pool, pool_task task, void *arg);
+void pool_wait(struct pool *pool);
+void pool_run(struct pool *pool, pool_task task, void *arg);
+void pool_destroy(struct pool *pool);
+
+#endif /* POOL_H_ */
@@ -0,0 +1,320 @@
+/*
+ * scale.c
+ *
+ * Box filter kernels summing the colors of canvas cells. The vector
+ * kernels are selected at run time according to the CPU.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCALE_X86
+#endif
+
+#include "scale.h"
+
+void scale_lut_init(struct scale_lut *lut, struct palette *palette)
+{
+	int i;
+
+	memset(lut, 0, sizeof(struct scale_lut));
+	lut->colors = palette->colors;
+	lut->len = palette->len;
+	if (palette->len > SCALE_LUT_MAX)
+		return;
+	for (i = 0; i < palette->len; i++) {
+		lut->r[i] = palette->colors[i].r;
+		lut->g[i] = palette->colors[i].g;
+		lut->b[i] = palette->colors[i].b;
+	}
+	if (palette->len >= SCALE_LUT_MAX)
+		return;
+	lut->r[SCALE_LUT_MAX - 1] = 255;
+	lut->g[SCALE_LUT_MAX - 1] = 255;
+	lut->b[SCALE_LUT_MAX - 1] = 255;
+	for (i = 0; i < 256; i++) {
+		lut->pairs[i][0] = lut->r[i & 0xF] + lut->r[i >> 4];
+		lut->pairs[i][1] = lut->g[i & 0xF] + lut->g[i >> 4];
+		lut->pairs[i][2] = lut->b[i & 0xF] + lut->b[i >> 4];
+	}
+}
+
+void box_sum_scalar(const char *cells, uint64_t stride, int rows, int cols,
+		const struct scale_lut *lut, int64_t sums[3])
+{
+	int i, j;
+	struct rgb *colors = lut->colors;
+
+	for (i = 0; i < rows; i++) {
+		const char *row = cells + i * stride;
+		for (j = 0; j < cols; j++) {
+			int id = row[j];
+			if (id >= 0) {
+				sums[0] += colors[id].r;
+				sums[1] += colors[id].g;
+				sums[2] += colors[id].b;
+			} else {
+				sums[0] += 255;
+				sums[1] += 255;
+				sums[2] += 255;
+			}
+		}
+	}
+}
+
+/*
+ * The palette fits in the lut, the empty nibble indexes its white entry.
+ * Rows are summed by whole bytes, the cell before an odd first cell and
+ * the cell after an even last cell being subtracted.
+ */
+static inline void packed_cell_sub(const char *canvas, uint64_t cell,
+		const struct scale_lut *lut, int64_t sums[3])
+{
+	int id = ((unsigned char) canvas[cell >> 1] >> ((cell & 1) << 2)) & 0xF;
+	sums[0] -= lut->r[id];
+	sums[1] -= lut->g[id];
+	sums[2] -= lut->b[id];
+}
+
+static inline void packed_row_bounds(const char *canvas, uint64_t cell, int cols,
+		const struct scale_lut *lut, int64_t sums[3], const char **row, int *bytes)
+{
+	uint64_t last = cell + cols;
+
+	if (cell & 1)
+		packed_cell_sub(canvas, cell - 1, lut, sums);
+	if (last & 1)
+		packed_cell_sub(canvas, last, lut, sums);
+	*row = canvas + (cell >> 1);
+	*bytes = ((last + 1) >> 1) - (cell >> 1);
+}
+
+static inline void packed_bytes_sum(const char *bytes, int count,
+		const struct scale_lut *lut, int64_t sums[3])
+{
+	int k;
+
+	for (k = 0; k < count; k++) {
+		const unsigned short *pair = lut->pairs[(unsigned char) bytes[k]];
+		sums[0] += pair[0];
+		sums[1] += pair[1];
+		sums[2] += pair[2];
+	}
+}
+
+void box_sum_packed_scalar(const char *canvas, uint64_t index, uint64_t stride,
+		int rows, int cols, const struct scale_lut *lut, int64_t sums[3])
+{
+	const char *row;
+	int bytes;
+	int i;
+
+	for (i = 0; i < rows && cols > 0; i++) {
+		packed_row_bounds(canvas, index + i * stride, cols, lut, sums, &row, &bytes);
+		packed_bytes_sum(row, bytes, lut, sums);
+	}
+}
+
+#ifdef SCALE_X86
+
+/* sum of the 64 bits lanes */
+static inline int64_t hsum_epi64(__m128i v)
+{
+	int64_t lanes[2];
+	_mm_storeu_si128((__m128i *) lanes, v);
+	return lanes[0] + lanes[1];
+}
+
+/*
+ * SSE2 has no byte shuffle: count the cells of each color with one compare
+ * per palette entry, then multiply the counts by the colors. Empty cells are
+ * the only negative values, counted with the sign mask.
+ */
+static void box_sum_sse2(const char *cells, uint64_t stride, int rows, int cols,
+		const struct scale_lut *lut, int64_t sums[3])
+{
+	int64_t count[SCALE_LUT_MAX] = { 0 };
+	__m128i ids[SCALE_LUT_MAX];
+	int64_t white = 0;
+	int i, j, k;
+
+	for (k = 0; k < lut->len; k++)
+		ids[k] = _mm_set1_epi8((char) k);
+
+	for (i = 0; i < rows; i++) {
+		const char *row = cells + i * stride;
+		for (j = 0; j + 16 <= cols; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (row + j));
+			white += __builtin_popcount(_mm_movemask_epi8(v));
+			for (k = 0; k < lut->len; k++)
+				count[k] += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, ids[k])));
+		}
+		for (; j < cols; j++) {
+			int id = row[j];
+			white += id < 0;
+			count[id & (SCALE_LUT_MAX - 1)] += id >= 0;
+		}
+	}
+	sums[0] += 255 * white;
+	sums[1] += 255 * white;
+	sums[2] += 255 * white;
+	for (k = 0; k < lut->len; k++) {
+		sums[0] += count[k] * lut->r[k];
+		sums[1] += count[k] * lut->g[k];
+		sums[2] += count[k] * lut->b[k];
+	}
+}
+
+/*
+ * The palette is looked up with a byte shuffle, 32 cells at a time. The
+ * shuffle returns 0 for indexes with the high bit set, so empty cells (-1)
+ * contribute nothing and are added as white from the sign mask. Bytes are
+ * summed in 64 bits lanes with psadbw.
+ */
+__attribute__((target("avx2")))
+static void box_sum_avx2(const char *cells, uint64_t stride, int rows, int cols,
+		const struct scale_lut *lut, int64_t sums[3])
+{
+	__m128i lr = _mm_load_si128((const __m128i *) lut->r);
+	__m128i lg = _mm_load_si128((const __m128i *) lut->g);
+	__m128i lb = _mm_load_si128((const __m128i *) lut->b);
+	__m256i lr2 = _mm256_broadcastsi128_si256(lr);
+	__m256i lg2 = _mm256_broadcastsi128_si256(lg);
+	__m256i lb2 = _mm256_broadcastsi128_si256(lb);
+	__m256i zero2 = _mm256_setzero_si256();
+	__m256i ar2 = zero2, ag2 = zero2, ab2 = zero2;
+	__m128i zero = _mm_setzero_si128();
+	__m128i ar = zero, ag = zero, ab = zero;
+	int64_t white = 0;
+	int i, j;
+
+	for (i = 0; i < rows; i++) {
+		const char *row = cells + i * stride;
+		for (j = 0; j + 32 <= cols; j += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) (row + j));
+			white += __builtin_popcount(_mm256_movemask_epi8(v));
+			ar2 = _mm256_add_epi64(ar2, _mm256_sad_epu8(_mm256_shuffle_epi8(lr2, v), zero2));
+			ag2 = _mm256_add_epi64(ag2, _mm256_sad_epu8(_mm256_shuffle_epi8(lg2, v), zero2));
+			ab2 = _mm256_add_epi64(ab2, _mm256_sad_epu8(_mm256_shuffle_epi8(lb2, v), zero2));
+		}
+		for (; j + 16 <= cols; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (row + j));
+			white += __builtin_popcount(_mm_movemask_epi8(v));
+			ar = _mm_add_epi64(ar, _mm_sad_epu8(_mm_shuffle_epi8(lr, v), zero));
+			ag = _mm_add_epi64(ag, _mm_sad_epu8(_mm_shuffle_epi8(lg, v), zero));
+			ab = _mm_add_epi64(ab, _mm_sad_epu8(_mm_shuffle_epi8(lb, v), zero));
+		}
+		for (; j < cols; j++) {
+			int id = row[j];
+			int mask = -(id >= 0);
+			white += id < 0;
+			sums[0] += lut->r[id & (SCALE_LUT_MAX - 1)] & mask;
+			sums[1] += lut->g[id & (SCALE_LUT_MAX - 1)] & mask;
+			sums[2] += lut->b[id & (SCALE_LUT_MAX - 1)] & mask;
+		}
+	}
+	ar = _mm_add_epi64(ar, _mm_add_epi64(_mm256_castsi256_si128(ar2), _mm256_extracti128_si256(ar2, 1)));
+	ag = _mm_add_epi64(ag, _mm_add_epi64(_mm256_castsi256_si128(ag2), _mm256_extracti128_si256(ag2, 1)));
+	ab = _mm_add_epi64(ab, _mm_add_epi64(_mm256_castsi256_si128(ab2), _mm256_extracti128_si256(ab2, 1)));
+	sums[0] += hsum_epi64(ar) + 255 * white;
+	sums[1] += hsum_epi64(ag) + 255 * white;
+	sums[2] += hsum_epi64(ab) + 255 * white;
+}
+
+/*
+ * The low and high nibbles of 32 bytes are looked up with two byte
+ * shuffles, white included, so 64 cells cost the shuffles and the psadbw
+ * of 32 cells of box_sum_avx2. The bytes left over go through the pairs.
+ */
+__attribute__((target("avx2")))
+static void box_sum_packed_avx2(const char *canvas, uint64_t index, uint64_t stride,
+		int rows, int cols, const struct scale_lut *lut, int64_t sums[3])
+{
+	__m128i lr = _mm_load_si128((const __m128i *) lut->r);
+	__m128i lg = _mm_load_si128((const __m128i *) lut->g);
+	__m128i lb = _mm_load_si128((const __m128i *) lut->b);
+	__m256i lr2 = _mm256_broadcastsi128_si256(lr);
+	__m256i lg2 = _mm256_broadcastsi128_si256(lg);
+	__m256i lb2 = _mm256_broadcastsi128_si256(lb);
+	__m256i nibble2 = _mm256_set1_epi8(0xF);
+	__m256i zero2 = _mm256_setzero_si256();
+	__m256i ar2 = zero2, ag2 = zero2, ab2 = zero2;
+	__m128i nibble = _mm_set1_epi8(0xF);
+	__m128i zero = _mm_setzero_si128();
+	__m128i ar = zero, ag = zero, ab = zero;
+	int i, j;
+
+	const char *row;
+	int bytes;
+
+	for (i = 0; i < rows && cols > 0; i++) {
+		packed_row_bounds(canvas, index + i * stride, cols, lut, sums, &row, &bytes);
+		for (j = 0; j + 32 <= bytes; j += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *) (row + j));
+			__m256i lo = _mm256_and_si256(v, nibble2);
+			__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble2);
+			ar2 = _mm256_add_epi64(ar2, _mm256_add_epi64(
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lr2, lo), zero2),
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lr2, hi), zero2)));
+			ag2 = _mm256_add_epi64(ag2, _mm256_add_epi64(
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lg2, lo), zero2),
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lg2, hi), zero2)));
+			ab2 = _mm256_add_epi64(ab2, _mm256_add_epi64(
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lb2, lo), zero2),
+					_mm256_sad_epu8(_mm256_shuffle_epi8(lb2, hi), zero2)));
+		}
+		for (; j + 16 <= bytes; j += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *) (row + j));
+			__m128i lo = _mm_and_si128(v, nibble);
+			__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+			ar = _mm_add_epi64(ar, _mm_add_epi64(_mm_sad_epu8(_mm_shuffle_epi8(lr, lo), zero),
+					_mm_sad_epu8(_mm_shuffle_epi8(lr, hi), zero)));
+			ag = _mm_add_epi64(ag, _mm_add_epi64(_mm_sad_epu8(_mm_shuffle_epi8(lg, lo), zero),
+					_mm_sad_epu8(_mm_shuffle_epi8(lg, hi), zero)));
+			ab = _mm_add_epi64(ab, _mm_add_epi64(_mm_sad_epu8(_mm_shuffle_epi8(lb, lo), zero),
+					_mm_sad_epu8(_mm_shuffle_epi8(lb, hi), zero)));
+		}
+		for (; j + 8 <= bytes; j += 8) {
+			__m128i v = _mm_loadl_epi64((const __m128i *) (row + j));
+			/* the high nibbles in the upper 8 bytes, summed by the other lane of psadbw */
+			v = _mm_and_si128(_mm_unpacklo_epi64(v, _mm_srli_epi16(v, 4)), nibble);
+			ar = _mm_add_epi64(ar, _mm_sad_epu8(_mm_shuffle_epi8(lr, v), zero));
+			ag = _mm_add_epi64(ag, _mm_sad_epu8(_mm_shuffle_epi8(lg, v), zero));
+			ab = _mm_add_epi64(ab, _mm_sad_epu8(_mm_shuffle_epi8(lb, v), zero));
+		}
+		packed_bytes_sum(row + j, bytes - j, lut, sums);
+	}
+	ar = _mm_add_epi64(ar, _mm_add_epi64(_mm256_castsi256_si128(ar2), _mm256_extracti128_si256(ar2, 1)));
+	ag = _mm_add_epi64(ag, _mm_add_epi64(_mm256_castsi256_si128(ag2), _mm256_extracti128_si256(ag2, 1)));
+	ab = _mm_add_epi64(ab, _mm_add_epi64(_mm256_castsi256_si128(ab2), _mm256_extracti128_si256(ab2, 1)));
+	sums[0] += hsum_epi64(ar);
+	sums[1] += hsum_epi64(ag);
+	sums[2] += hsum_epi64(ab);
+}
+
+#endif /* SCALE_X86 */
+
+box_sum_packed_t box_sum_packed_select(__attribute__((unused)) const struct scale_lut *lut)
+{
+#ifdef SCALE_X86
+	if (__builtin_cpu_supports("avx2"))
+		return box_sum_packed_avx2;
+#endif
+	return box_sum_packed_scalar;
+}
+
+box_sum_t box_sum_select(const struct scale_lut *lut)
+{
+	if (lut->len > SCALE_LUT_MAX)
+		return box_sum_scalar;
+#ifdef SCALE_X86
+	if (__builtin_cpu_supports("avx2"))
+		return box_sum_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return box_sum_sse2;
+#endif
+	return box_sum_scalar;
+}
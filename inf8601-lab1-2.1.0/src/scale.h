@@ -0,0 +1,72 @@
+/*
+ * scale.h
+ *
+ *  Box filter kernels used by scale_dragon
+ */
+
+#ifndef SCALE_H_
+#define SCALE_H_
+
+#include <stdint.h>
+#include "color.h"
+
+/* palettes up to this size fit in a byte shuffle */
+#define SCALE_LUT_MAX 16
+
+/*
+ * Palette split by channel. Entry id of each table is the channel of
+ * colors[id]; the canvas value -1 (white) is handled by the kernels. When
+ * the palette leaves it free, the last entry is white, the empty nibble of
+ * packed canvases, and pairs holds the channels summed over the two cells
+ * of each packed byte.
+ */
+struct scale_lut {
+	unsigned char r[SCALE_LUT_MAX] __attribute__((aligned(16)));
+	unsigned char g[SCALE_LUT_MAX] __attribute__((aligned(16)));
+	unsigned char b[SCALE_LUT_MAX] __attribute__((aligned(16)));
+	unsigned short pairs[256][3];
+	struct rgb *colors;
+	int len;
+};
+
+/*
+ * Add the colors of the rows x cols cells at cells (rows are stride cells
+ * apart) to sums[0..2].
+ */
+typedef void (*box_sum_t)(const char *cells, uint64_t stride, int rows, int cols,
+		const struct scale_lut *lut, int64_t sums[3]);
+
+/*
+ * Same as box_sum_t for a packed canvas, two cells per byte, the first
+ * cell being at the cell index of canvas.
+ */
+typedef void (*box_sum_packed_t)(const char *canvas, uint64_t index, uint64_t stride,
+		int rows, int cols, const struct scale_lut *lut, int64_t sums[3]);
+
+void scale_lut_init(struct scale_lut *lut, struct palette *palette);
+box_sum_t box_sum_select(const struct scale_lut *lut);
+void box_sum_scalar(const char *cells, uint64_t stride, int rows, int cols,
+		const struct scale_lut *lut, int64_t sums[3]);
+box_sum_packed_t box_sum_packed_select(const struct scale_lut *lut);
+void box_sum_packed_scalar(const char *canvas, uint64_t index, uint64_t stride,
+		int rows, int cols, const struct scale_lut *lut, int64_t sums[3]);
+
+/*
+ * x / d computed as (x * recip[d]) >> SCALE_RECIP_SHIFT, exact as long as
+ * x * d < 2^SCALE_RECIP_SHIFT, which holds for x <= 255 * d and
+ * d <= SCALE_RECIP_MAX.
+ */
+#define SCALE_RECIP_SHIFT	48
+#define SCALE_RECIP_MAX		(1 << 20)
+
+static inline uint64_t scale_recip(uint64_t d)
+{
+	return ((1ULL << SCALE_RECIP_SHIFT) / d) + 1;
+}
+
+static inline unsigned char scale_div(uint64_t x, uint64_t recip)
+{
+	return (unsigned char) ((x * recip) >> SCALE_RECIP_SHIFT);
+}
+
+#endif /* SCALE_H_ */
@@ -0,0 +1,172 @@
+/*
+ * writer.c
+ *
+ * A thread encodes and writes the queued images while the caller computes
+ * the next one. The caller only waits when all the buffers are queued, and
+ * at the end for the last images: the rest of the writing time is hidden.
+ * Encoding runs on a pool of the writer, the global pool being busy with
+ * the computation.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "dragon.h"
+#include "encode.h"
+#include "metrics.h"
+#include "writer.h"
+
+static void *writer_main(void *data)
+{
+	struct writer *writer = (struct writer *) data;
+
+	pthread_mutex_lock(&writer->lock);
+	for (;;) {
+		while (writer->count == 0 && !writer->stop)
+			pthread_cond_wait(&writer->queued, &writer->lock);
+		if (writer->count == 0)
+			break;
+		struct rgb *image = writer->images[writer->head];
+		char *file = writer->files[writer->head];
+		pthread_mutex_unlock(&writer->lock);
+
+		double begin = metrics_now();
+		long written = encode_img_pool(writer->pool, image, file, writer->width,
+				writer->height);
+		double ms = metrics_now() - begin;
+		FREE(file);
+
+		pthread_mutex_lock(&writer->lock);
+		if (written < 0)
+			writer->err = 1;
+		writer->busy += ms;
+		writer->written++;
+		writer->head = (writer->head + 1) % writer->nb_buffer;
+		writer->count--;
+		writer->idle[writer->nb_idle++] = image;
+		pthread_cond_signal(&writer->released);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return NULL;
+}
+
+struct writer *writer_create(int width, int height, int nb_buffer, int nb_thread)
+{
+	struct writer *writer;
+	int i;
+
+	if ((writer = calloc(1, sizeof(struct writer))) == NULL)
+		return NULL;
+	writer->width = width;
+	writer->height = height;
+	writer->nb_buffer = nb_buffer;
+	writer->joined = 1;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->queued, NULL);
+	pthread_cond_init(&writer->released, NULL);
+	if ((writer->buffers = calloc(nb_buffer, sizeof(struct rgb *))) == NULL ||
+			(writer->idle = calloc(nb_buffer, sizeof(struct rgb *))) == NULL ||
+			(writer->images = calloc(nb_buffer, sizeof(struct rgb *))) == NULL ||
+			(writer->files = calloc(nb_buffer, sizeof(char *))) == NULL)
+		goto err;
+	for (i = 0; i < nb_buffer; i++) {
+		if ((writer->buffers[i] = make_canvas(width, height)) == NULL)
+			goto err;
+		writer->idle[writer->nb_idle++] = writer->buffers[i];
+	}
+	if ((writer->pool = pool_create(nb_thread)) == NULL)
+		goto err;
+	if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0)
+		goto err;
+	writer->joined = 0;
+	return writer;
+
+err:
+	printf("writer init error\n");
+	writer_free(writer);
+	return NULL;
+}
+
+/* buffer to render the next image in, waiting for the writer if none is idle */
+struct rgb *writer_buffer(struct writer *writer)
+{
+	struct rgb *image;
+	double begin = metrics_now();
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->nb_idle == 0)
+		pthread_cond_wait(&writer->released, &writer->lock);
+	image = writer->idle[--writer->nb_idle];
+	writer->wait += metrics_now() - begin;
+	pthread_mutex_unlock(&writer->lock);
+	return image;
+}
+
+/* queue image, a buffer of the writer, to be written to file, freed once written */
+int writer_submit(struct writer *writer, struct rgb *image, char *file)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&writer->lock);
+	if (writer->err) {
+		ret = -1;
+		writer->idle[writer->nb_idle++] = image;
+		FREE(file);
+	} else {
+		int tail = (writer->head + writer->count) % writer->nb_buffer;
+		writer->images[tail] = image;
+		writer->files[tail] = file;
+		writer->count++;
+		pthread_cond_signal(&writer->queued);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return ret;
+}
+
+/* wait for the queued images, returns -1 if one of them was not written */
+int writer_finish(struct writer *writer)
+{
+	double begin = metrics_now();
+	double hidden;
+
+	if (writer->joined)
+		return writer->err ? -1 : 0;
+	pthread_mutex_lock(&writer->lock);
+	writer->stop = 1;
+	pthread_cond_signal(&writer->queued);
+	pthread_mutex_unlock(&writer->lock);
+	pthread_join(writer->thread, NULL);
+	writer->joined = 1;
+	writer->wait += metrics_now() - begin;
+
+	hidden = writer->busy - writer->wait;
+	if (hidden < 0)
+		hidden = 0;
+	printf("Async write: %d images, %d milliseconds writing, %d milliseconds waited, "
+			"%d milliseconds hidden (%.0f%%)\n", writer->written, (int) writer->busy,
+			(int) writer->wait, (int) hidden,
+			writer->busy > 0 ? 100 * hidden / writer->busy : 0);
+	return writer->err ? -1 : 0;
+}
+
+void writer_free(struct writer *writer)
+{
+	int i;
+
+	if (writer == NULL)
+		return;
+	writer_finish(writer);
+	pool_destroy(writer->pool);
+	for (i = 0; writer->buffers != NULL && i < writer->nb_buffer; i++)
+		FREE(writer->buffers[i]);
+	FREE(writer->buffers);
+	FREE(writer->idle);
+	FREE(writer->images);
+	FREE(writer->files);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->queued);
+	pthread_cond_destroy(&writer->released);
+	free(writer);
+}
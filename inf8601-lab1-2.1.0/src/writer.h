@@ -0,0 +1,53 @@
+/*
+ * writer.h
+ *
+ *  Asynchronous output of the images of a multi-image run
+ */
+
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <pthread.h>
+
+#include "color.h"
+#include "pool.h"
+
+/*
+ * The images are rendered in buffers of the writer and queued to its
+ * thread, which encodes them while the next one is computed. With 2
+ * buffers, one is rendered while the other is written.
+ */
+struct writer {
+	int width;
+	int height;
+	int nb_buffer;
+	struct rgb **buffers;
+	/* buffers neither rendered nor queued */
+	struct rgb **idle;
+	int nb_idle;
+	/* queue of the images to write, at most nb_buffer */
+	struct rgb **images;
+	char **files;
+	int head;
+	int count;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t released;
+	struct pool *pool;
+	int stop;
+	int joined;
+	int err;
+	int written;
+	/* ms spent writing, and waiting for the writer in the producer */
+	double busy;
+	double wait;
+};
+
+struct writer *writer_create(int width, int height, int nb_buffer, int nb_thread);
+struct rgb *writer_buffer(struct writer *writer);
+int writer_submit(struct writer *writer, struct rgb *image, char *file);
+int writer_finish(struct writer *writer);
+void writer_free(struct writer *writer);
+
+#endif /* WRITER_H_ */
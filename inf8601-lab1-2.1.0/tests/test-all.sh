@@ -1,4 +1,27 @@
 #!/bin/sh
 
-${abs_top_srcdir}/src/dragonizer --cmd check --power 22 --thread 10
+set -e
 
+DRAGONIZER=${abs_top_srcdir}/src/dragonizer
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+$DRAGONIZER --cmd check --power 22 --thread 10
+# odd thread counts and the tiled layout, in the draws and the sweep
+$DRAGONIZER --cmd check --power 19 --thread 3 --layout tiled
+# two cells per byte, the odd thread counts share the bytes of the canvas
+$DRAGONIZER --cmd check --power 19 --thread 3 --packing nibble
+$DRAGONIZER --cmd check --power 19 --thread 5 --packing nibble --layout tiled
+# check also reads back the .ppm, .qoi and .png of the image: with 10 threads,
+# each of the 23 odd-width rows is a stripe of the encoders
+$DRAGONIZER --cmd check --power 16 --thread 10 --width 67 --height 23
+
+# the last frame and the output of an incremental sweep are the fresh draw,
+# one thread gives the same colors
+$DRAGONIZER --cmd draw --lib pthread --thread 1 --power 17 -o "$TMP/fresh.ppm" > /dev/null
+for buffers in 0 2; do
+	$DRAGONIZER --cmd draw --lib pthread --thread 1 --power 10 --max 17 --incremental \
+		--frames --write-buffers $buffers -o "$TMP/sweep.ppm" > /dev/null
+	cmp "$TMP/fresh.ppm" "$TMP/sweep.ppm"
+	cmp "$TMP/fresh.ppm" "$TMP/sweep-17.ppm"
+done